@@ -1,12 +1,18 @@
 #include "devices/disk.h"
 #include <ctype.h>
 #include <debug.h>
+#include <round.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
+#include "devices/pci.h"
 #include "devices/timer.h"
+#include "devices/virtio-blk.h"
 #include "threads/io.h"
 #include "threads/interrupt.h"
+#include "threads/palloc.h"
 #include "threads/synch.h"
+#include "threads/vaddr.h"
 
 /* The code in this file is an interface to an ATA (IDE)
    controller.  It attempts to comply to [ATA-3]. */
@@ -28,10 +34,27 @@
 #define reg_ctl(CHANNEL) ((CHANNEL)->reg_base + 0x206)  /* Control (w/o). */
 #define reg_alt_status(CHANNEL) reg_ctl (CHANNEL)       /* Alt Status (r/o). */
 
+/* Bus master IDE port addresses, relative to the channel's
+   bmi_base. */
+#define reg_bm_command(CHANNEL) ((CHANNEL)->bmi_base + 0) /* Command. */
+#define reg_bm_status(CHANNEL) ((CHANNEL)->bmi_base + 2)  /* Status. */
+#define reg_bm_prdt(CHANNEL) ((CHANNEL)->bmi_base + 4)    /* PRD table. */
+
+/* Bus master Command Register bits. */
+#define BM_CMD_START 0x01       /* Start/stop the transfer. */
+#define BM_CMD_READ 0x08        /* Transfer from disk to memory. */
+
+/* Bus master Status Register bits.  The last two are cleared by
+   writing 1 to them. */
+#define BM_STA_ACTIVE 0x01      /* Transfer in progress. */
+#define BM_STA_ERR 0x02         /* Transfer failed. */
+#define BM_STA_INTR 0x04        /* Disk asserted its interrupt. */
+
 /* Alternate Status Register bits. */
 #define STA_BSY 0x80            /* Busy. */
 #define STA_DRDY 0x40           /* Device Ready. */
 #define STA_DRQ 0x08            /* Data Request. */
+#define STA_ERR 0x01            /* Error. */
 
 /* Control Register bits. */
 #define CTL_SRST 0x04           /* Software Reset. */
@@ -47,6 +70,50 @@
 #define CMD_IDENTIFY_DEVICE 0xec        /* IDENTIFY DEVICE. */
 #define CMD_READ_SECTOR_RETRY 0x20      /* READ SECTOR with retries. */
 #define CMD_WRITE_SECTOR_RETRY 0x30     /* WRITE SECTOR with retries. */
+#define CMD_READ_MULTIPLE 0xc4          /* READ MULTIPLE. */
+#define CMD_WRITE_MULTIPLE 0xc5         /* WRITE MULTIPLE. */
+#define CMD_SET_MULTIPLE_MODE 0xc6      /* SET MULTIPLE MODE. */
+#define CMD_READ_DMA 0xc8               /* READ DMA. */
+#define CMD_WRITE_DMA 0xca              /* WRITE DMA. */
+
+/* Most sectors one command can transfer: a sector count of 0
+   means 256. */
+#define NSECT_MAX 256
+
+/* Most sectors per interrupt we ask for with SET MULTIPLE MODE. */
+#define MULTIPLE_MAX 16
+
+/* A physical region descriptor: one piece of memory that a DMA
+   transfer reads or writes.  A region may not cross a 64 kB
+   boundary. */
+struct prd
+  {
+    uint32_t addr;              /* Physical address. */
+    uint16_t size;              /* Size in bytes, 0 meaning 64 kB. */
+    uint16_t flags;             /* PRD_EOT on the last descriptor. */
+  };
+#define PRD_EOT 0x8000          /* End of table. */
+
+/* Most requests merged into one command. */
+#define MERGE_MAX 32
+
+/* A request that has waited this many timer ticks is started
+   next, whatever its sector. */
+#define DEADLINE_TICKS (TIMER_FREQ / 2)
+
+/* A PRD table fills one page.  That is enough for NSECT_MAX
+   sectors even if each of them is split at a 64 kB boundary. */
+#define PRD_CNT (PGSIZE / sizeof (struct prd))
+
+/* Use bus-master DMA where possible?  Set by -dma. */
+bool disk_dma;
+
+/* Time stamp counter cycles per microsecond, measured at
+   disk_init(). */
+static uint64_t tsc_per_us;
+
+static const char *class_names[DISK_CLASS_CNT] =
+  {"other", "fs data", "fs meta", "swap in", "swap out", "write-behind"};
 
 /* An ATA device. */
 struct disk 
@@ -57,9 +124,17 @@ struct disk
 
     bool is_ata;                /* 1=This device is an ATA disk. */
     disk_sector_t capacity;     /* Capacity in sectors (if is_ata). */
+    int multiple;               /* Sectors per interrupt with READ/WRITE
+                                   MULTIPLE, or 0 to use READ/WRITE
+                                   SECTOR. */
+    bool dma_capable;           /* Supports DMA (if is_ata)? */
+    bool use_dma;               /* Transfer by DMA rather than PIO? */
+
+    uint8_t *ram;               /* Contents, if a RAM disk. */
+    bool virtio;                /* Is this the virtio block device? */
 
-    long long read_cnt;         /* Number of sectors read. */
-    long long write_cnt;        /* Number of sectors written. */
+    struct disk_stats stats;    /* Statistics.  Protected by disabling
+                                   interrupts. */
   };
 
 /* An ATA channel (aka controller).
@@ -70,10 +145,32 @@ struct channel
     uint16_t reg_base;          /* Base I/O port. */
     uint8_t irq;                /* Interrupt in use. */
 
-    struct lock lock;           /* Must acquire to access the controller. */
     bool expecting_interrupt;   /* True if an interrupt is expected, false if
                                    any interrupt would be spurious. */
-    struct semaphore completion_wait;   /* Up'd by interrupt handler. */
+    struct semaphore completion_wait;   /* Up'd by interrupt handler
+                                           while detecting disks. */
+
+    /* Requests are carried out one command at a time, picked and
+       merged by start_request().  These members are protected by
+       disabling interrupts. */
+    struct list queue;          /* Submitted requests not yet started,
+                                   oldest first. */
+    uint32_t head;              /* Sort key just past the last command. */
+
+    /* The command in progress: CMD_CNT sectors of CMD_DISK from
+       CMD_SEC, made of the current chunks of the CMD_REQ_CNT
+       requests in CMD_REQS, in sector order.  The channel is idle
+       if CMD_REQ_CNT is 0. */
+    struct disk *cmd_disk;
+    bool cmd_write;
+    disk_sector_t cmd_sec;
+    size_t cmd_cnt;
+    size_t cmd_pos;             /* Sectors transferred so far. */
+    struct disk_request *cmd_reqs[MERGE_MAX];
+    size_t cmd_req_cnt;
+
+    uint16_t bmi_base;          /* Bus master I/O base, 0 if none. */
+    struct prd *prdt;           /* PRD table for DMA transfers. */
 
     struct disk devices[2];     /* The devices on this channel. */
   };
@@ -82,27 +179,97 @@ struct channel
 #define CHANNEL_CNT 2
 static struct channel channels[CHANNEL_CNT];
 
+/* Size in kB of the RAM disk to use for each role instead of its
+   usual ATA disk, or 0 for none.  Set by -ramdisk-fs and
+   -ramdisk-swap. */
+size_t disk_ram_size[DISK_ROLE_CNT];
+
+/* RAM disks, one per role, on no channel. */
+static struct disk ram_disks[DISK_ROLE_CNT];
+static const char *role_names[DISK_ROLE_CNT] = {"ramfs", "ramswap"};
+
+/* Role to give the virtio block device, DISK_ROLE_CNT for none. */
+enum disk_role disk_virtio_role = DISK_ROLE_CNT;
+
+/* The virtio block device, on no channel, and the requests
+   submitted to it that did not fit in its queue, oldest first.
+   The list is protected by disabling interrupts. */
+static struct disk virtio_disk;
+static struct list virtio_pending;
+
 static void reset_channel (struct channel *);
 static bool check_device_type (struct disk *);
 static void identify_ata_device (struct disk *);
-
-static void select_sector (struct disk *, disk_sector_t);
+static void set_multiple_mode (struct disk *, int max);
+static void init_ram_disk (enum disk_role);
+static void ram_transfer (struct disk_request *);
+static void init_virtio_disk (void);
+static void virtio_start (void);
+static void virtio_done (struct disk_request *);
+static void init_bus_master (void);
+
+static void transfer (struct disk *, disk_sector_t, size_t cnt,
+                      void *buffer, bool write, enum disk_class);
+static void account_request (struct disk_request *);
+static void *sector_buffer (const struct disk_request *, size_t);
+static bool requests_conflict (const struct disk_request *,
+                               const struct disk_request *);
+static bool conflicts_queued (struct channel *, const struct disk_request *);
+static void start_request (struct channel *);
+static void start_command (struct channel *);
+static void pio_block (struct channel *);
+static void advance_request (struct channel *);
+static void start_dma (struct channel *);
+static void finish_dma (struct channel *);
+static void select_sector (struct disk *, disk_sector_t, size_t cnt);
 static void issue_pio_command (struct channel *, uint8_t command);
 static void input_sector (struct channel *, void *);
 static void output_sector (struct channel *, const void *);
 
 static void wait_until_idle (const struct disk *);
 static bool wait_while_busy (const struct disk *);
+static bool poll_while_busy (const struct disk *);
+static void delay_400ns (const struct channel *);
 static void select_device (const struct disk *);
 static void select_device_wait (const struct disk *);
 
 static void interrupt_handler (struct intr_frame *);
 
+/* Returns the processor's time stamp counter. */
+static inline uint64_t
+rdtsc (void) 
+{
+  uint64_t tsc;
+  asm volatile ("rdtsc" : "=A" (tsc));
+  return tsc;
+}
+
+/* Sets tsc_per_us by timing one timer tick. */
+static void
+calibrate_tsc (void) 
+{
+  int64_t start = timer_ticks ();
+  uint64_t tsc;
+
+  while (timer_ticks () == start)
+    continue;
+  tsc = rdtsc ();
+  start = timer_ticks ();
+  while (timer_ticks () == start)
+    continue;
+  tsc_per_us = (rdtsc () - tsc) * TIMER_FREQ / 1000000;
+  if (tsc_per_us == 0)
+    tsc_per_us = 1;
+}
+
 /* Initialize the disk subsystem and detect disks. */
 void
 disk_init (void) 
 {
   size_t chan_no;
+  int role;
+
+  calibrate_tsc ();
 
   for (chan_no = 0; chan_no < CHANNEL_CNT; chan_no++)
     {
@@ -124,9 +291,13 @@ disk_init (void)
         default:
           NOT_REACHED ();
         }
-      lock_init (&c->lock);
       c->expecting_interrupt = false;
       sema_init (&c->completion_wait, 0);
+      list_init (&c->queue);
+      c->head = 0;
+      c->cmd_req_cnt = 0;
+      c->bmi_base = 0;
+      c->prdt = NULL;
  
       /* Initialize devices. */
       for (dev_no = 0; dev_no < 2; dev_no++)
@@ -138,8 +309,10 @@ disk_init (void)
 
           d->is_ata = false;
           d->capacity = 0;
+          d->multiple = 0;
+          d->dma_capable = d->use_dma = false;
 
-          d->read_cnt = d->write_cnt = 0;
+          memset (&d->stats, 0, sizeof d->stats);
         }
 
       /* Register interrupt handler. */
@@ -157,13 +330,172 @@ disk_init (void)
         if (c->devices[dev_no].is_ata)
           identify_ata_device (&c->devices[dev_no]);
     }
+
+  if (disk_dma)
+    init_bus_master ();
+
+  for (role = 0; role < DISK_ROLE_CNT; role++)
+    if (disk_ram_size[role] > 0)
+      init_ram_disk (role);
+
+  if (disk_virtio_role < DISK_ROLE_CNT)
+    init_virtio_disk ();
+}
+
+/* Sets up the RAM disk for ROLE, of disk_ram_size[ROLE] kB. */
+static void
+init_ram_disk (enum disk_role role) 
+{
+  struct disk *d = &ram_disks[role];
+  size_t pages = DIV_ROUND_UP (disk_ram_size[role] * 1024, PGSIZE);
+
+  d->ram = palloc_get_multiple (PAL_ZERO, pages);
+  if (d->ram == NULL)
+    PANIC ("not enough memory for a %zu kB RAM disk", disk_ram_size[role]);
+  strlcpy (d->name, role_names[role], sizeof d->name);
+  d->channel = NULL;
+  d->capacity = pages * PGSIZE / DISK_SECTOR_SIZE;
+  printf ("%s: %'"PRDSNu" sector RAM disk\n", d->name, d->capacity);
+}
+
+/* Sets up the virtio block device as disk "vda". */
+static void
+init_virtio_disk (void) 
+{
+  struct disk *d = &virtio_disk;
+
+  list_init (&virtio_pending);
+  if (!virtio_blk_init (virtio_done))
+    {
+      printf ("vda: no virtio block device, using the IDE disks\n");
+      return;
+    }
+  strlcpy (d->name, "vda", sizeof d->name);
+  d->channel = NULL;
+  d->capacity = virtio_blk_capacity ();
+  d->virtio = true;
+}
+
+/* Returns the disk to use for ROLE: its RAM disk, if one was asked
+   for, then the virtio block device, if -virtio gave it ROLE,
+   otherwise hd0:1 for the file system and hd1:1 for swap.
+   Returns a null pointer if that disk does not exist. */
+struct disk *
+disk_get_role (enum disk_role role) 
+{
+  ASSERT (role < DISK_ROLE_CNT);
+
+  if (ram_disks[role].ram != NULL)
+    return &ram_disks[role];
+  if (virtio_disk.virtio && disk_virtio_role == role)
+    return &virtio_disk;
+  return role == DISK_ROLE_FS ? disk_get (0, 1) : disk_get (1, 1);
+}
+
+/* Finds the PCI IDE controller that the legacy channels belong to
+   and, if it can do bus-master DMA, sets up every channel for it
+   and switches over the disks that support DMA. */
+static void
+init_bus_master (void) 
+{
+  struct pci_addr a;
+  uint32_t class, command, bar4;
+  size_t chan_no;
+
+  if (!pci_find_class (0x01, 0x01, &a))
+    return;
+
+  /* Bits 0 and 2 of the programming interface are set if a channel
+     is in native mode, at ports other than the legacy ones we
+     drive.  Bit 7 is set if the controller can be bus master. */
+  class = pci_read_config (&a, PCI_REG_CLASS);
+  if ((class & 0x0500) != 0 || (class & 0x8000) == 0)
+    return;
+
+  /* BAR4 holds the bus master I/O ports, 8 per channel. */
+  bar4 = pci_read_config (&a, PCI_REG_BAR0 + 4 * 4);
+  if ((bar4 & 1) == 0 || (bar4 & ~3u) == 0)
+    return;
+  command = pci_read_config (&a, PCI_REG_COMMAND);
+  pci_write_config (&a, PCI_REG_COMMAND,
+                    command | PCI_CMD_IO | PCI_CMD_MASTER);
+
+  for (chan_no = 0; chan_no < CHANNEL_CNT; chan_no++)
+    {
+      struct channel *c = &channels[chan_no];
+      int dev_no;
+
+      c->prdt = palloc_get_page (PAL_ZERO);
+      if (c->prdt == NULL)
+        continue;
+      c->bmi_base = (bar4 & ~3u) + 8 * chan_no;
+      for (dev_no = 0; dev_no < 2; dev_no++)
+        if (c->devices[dev_no].dma_capable)
+          {
+            c->devices[dev_no].use_dma = true;
+            printf ("%s: using bus-master DMA\n", c->devices[dev_no].name);
+          }
+    }
+}
+
+/* Prints the non-empty buckets of latency histogram HIST, for
+   disk NAME, titled TITLE. */
+static void
+print_hist (const char *name, const char *title, const long long hist[]) 
+{
+  int i;
+
+  printf ("%s: %s:", name, title);
+  for (i = 0; i < DISK_HIST_CNT; i++)
+    if (hist[i] > 0) 
+      {
+        if (i == DISK_HIST_CNT - 1)
+          printf (" >=%lldus:%lld", 1LL << (i - 1), hist[i]);
+        else
+          printf (" <%lldus:%lld", 1LL << i, hist[i]);
+      }
+  printf ("\n");
+}
+
+/* Prints the statistics of disk D. */
+static void
+print_disk_stats (struct disk *d) 
+{
+  struct disk_stats st;
+  long long submitted, depth_avg;
+  int class;
+
+  disk_get_stats (d, &st);
+  submitted = st.depth;
+  printf ("%s: %lld reads, %lld writes, %lld commands, "
+          "%lld merged requests\n",
+          d->name, st.read_cnt, st.write_cnt, st.command_cnt,
+          st.merge_cnt);
+  for (class = 0; class < DISK_CLASS_CNT; class++) 
+    {
+      const struct disk_class_stats *cs = &st.class[class];
+      submitted += cs->requests;
+      if (cs->requests > 0)
+        printf ("%s: %s: %lld requests, %lld sectors, "
+                "%lld us avg wait, %lld us avg service\n",
+                d->name, class_names[class], cs->requests,
+                cs->sectors, cs->wait_us / cs->requests,
+                cs->service_us / cs->requests);
+    }
+  print_hist (d->name, "queue wait", st.wait_hist);
+  print_hist (d->name, "service", st.service_hist);
+  depth_avg = submitted > 0 ? st.depth_sum * 100 / submitted : 0;
+  printf ("%s: queue depth %lld now, %lld max, %lld.%02lld avg "
+          "seen by new requests\n",
+          d->name, st.depth, st.depth_max,
+          depth_avg / 100, depth_avg % 100);
 }
 
 /* Prints disk statistics. */
 void
 disk_print_stats (void) 
 {
-  int chan_no;
+  int chan_no, role;
 
   for (chan_no = 0; chan_no < CHANNEL_CNT; chan_no++) 
     {
@@ -172,11 +504,62 @@ disk_print_stats (void)
       for (dev_no = 0; dev_no < 2; dev_no++) 
         {
           struct disk *d = disk_get (chan_no, dev_no);
-          if (d != NULL && d->is_ata) 
-            printf ("%s: %lld reads, %lld writes\n",
-                    d->name, d->read_cnt, d->write_cnt);
+          if (d != NULL && d->is_ata)
+            print_disk_stats (d);
         }
     }
+  for (role = 0; role < DISK_ROLE_CNT; role++)
+    if (ram_disks[role].ram != NULL)
+      print_disk_stats (&ram_disks[role]);
+  if (virtio_disk.virtio)
+    print_disk_stats (&virtio_disk);
+}
+
+/* Copies disk D's statistics into *OUT. */
+void
+disk_get_stats (struct disk *d, struct disk_stats *out) 
+{
+  enum intr_level old_level;
+
+  ASSERT (d != NULL);
+
+  old_level = intr_disable ();
+  *out = d->stats;
+  intr_set_level (old_level);
+}
+
+/* Returns the histogram bucket for a latency of US microseconds. */
+static int
+hist_bucket (uint64_t us) 
+{
+  int i = 0;
+
+  while (us > 0 && i < DISK_HIST_CNT - 1) 
+    {
+      us >>= 1;
+      i++;
+    }
+  return i;
+}
+
+/* Records the completion of request R in its disk's statistics.
+   Interrupts must be off. */
+static void
+account_request (struct disk_request *r) 
+{
+  struct disk_stats *st = &r->disk->stats;
+  struct disk_class_stats *cs = &st->class[r->class];
+  uint64_t now = rdtsc ();
+  uint64_t wait_us = (r->start_tsc - r->submit_tsc) / tsc_per_us;
+  uint64_t service_us = (now - r->start_tsc) / tsc_per_us;
+
+  cs->requests++;
+  cs->sectors += r->cnt;
+  cs->wait_us += wait_us;
+  cs->service_us += service_us;
+  st->wait_hist[hist_bucket (wait_us)]++;
+  st->service_hist[hist_bucket (service_us)]++;
+  st->depth--;
 }
 
 /* Returns the disk numbered DEV_NO--either 0 or 1 for master or
@@ -202,6 +585,44 @@ disk_get (int chan_no, int dev_no)
   return NULL;
 }
 
+/* Returns the disk called NAME, e.g. "hd1:1", "ramswap" or "vda",
+   or a null pointer if there is no such disk. */
+struct disk *
+disk_find (const char *name) 
+{
+  int chan_no, dev_no, role;
+
+  for (chan_no = 0; chan_no < CHANNEL_CNT; chan_no++)
+    for (dev_no = 0; dev_no < 2; dev_no++) 
+      {
+        struct disk *d = disk_get (chan_no, dev_no);
+        if (d != NULL && !strcmp (d->name, name))
+          return d;
+      }
+  for (role = 0; role < DISK_ROLE_CNT; role++)
+    if (ram_disks[role].ram != NULL && !strcmp (ram_disks[role].name, name))
+      return &ram_disks[role];
+  if (virtio_disk.virtio && !strcmp (virtio_disk.name, name))
+    return &virtio_disk;
+  return NULL;
+}
+
+/* Returns the number of requests submitted to disk D that have
+   not completed yet. */
+long long
+disk_queue_depth (struct disk *d) 
+{
+  enum intr_level old_level;
+  long long depth;
+
+  ASSERT (d != NULL);
+
+  old_level = intr_disable ();
+  depth = d->stats.depth;
+  intr_set_level (old_level);
+  return depth;
+}
+
 /* Returns the size of disk D, measured in DISK_SECTOR_SIZE-byte
    sectors. */
 disk_sector_t
@@ -219,21 +640,7 @@ disk_size (struct disk *d)
 void
 disk_read (struct disk *d, disk_sector_t sec_no, void *buffer) 
 {
-  struct channel *c;
-  
-  ASSERT (d != NULL);
-  ASSERT (buffer != NULL);
-
-  c = d->channel;
-  lock_acquire (&c->lock);
-  select_sector (d, sec_no);
-  issue_pio_command (c, CMD_READ_SECTOR_RETRY);
-  sema_down (&c->completion_wait);
-  if (!wait_while_busy (d))
-    PANIC ("%s: disk read failed, sector=%"PRDSNu, d->name, sec_no);
-  input_sector (c, buffer);
-  d->read_cnt++;
-  lock_release (&c->lock);
+  disk_read_multiple (d, sec_no, 1, buffer, DISK_OTHER);
 }
 
 /* Write sector SEC_NO to disk D from BUFFER, which must contain
@@ -244,23 +651,549 @@ disk_read (struct disk *d, disk_sector_t sec_no, void *buffer)
 void
 disk_write (struct disk *d, disk_sector_t sec_no, const void *buffer)
 {
-  struct channel *c;
-  
-  ASSERT (d != NULL);
+  disk_write_multiple (d, sec_no, 1, buffer, DISK_OTHER);
+}
+
+/* Reads the CNT sectors starting at SEC_NO from disk D into
+   BUFFER, which must have room for CNT * DISK_SECTOR_SIZE bytes,
+   on behalf of CLASS.  Takes one command per 256 sectors rather
+   than one per sector. */
+void
+disk_read_multiple (struct disk *d, disk_sector_t sec_no, size_t cnt,
+                    void *buffer, enum disk_class class)
+{
   ASSERT (buffer != NULL);
+  transfer (d, sec_no, cnt, buffer, false, class);
+}
 
-  c = d->channel;
-  lock_acquire (&c->lock);
-  select_sector (d, sec_no);
-  issue_pio_command (c, CMD_WRITE_SECTOR_RETRY);
-  if (!wait_while_busy (d))
-    PANIC ("%s: disk write failed, sector=%"PRDSNu, d->name, sec_no);
-  output_sector (c, buffer);
-  sema_down (&c->completion_wait);
-  d->write_cnt++;
-  lock_release (&c->lock);
+/* Writes the CNT sectors starting at SEC_NO to disk D from
+   BUFFER, which must contain CNT * DISK_SECTOR_SIZE bytes, on
+   behalf of CLASS.  Returns after the disk has acknowledged
+   receiving the data. */
+void
+disk_write_multiple (struct disk *d, disk_sector_t sec_no, size_t cnt,
+                     const void *buffer, enum disk_class class)
+{
+  ASSERT (buffer != NULL);
+  transfer (d, sec_no, cnt, (void *) buffer, true, class);
 }
-
+
+/* Submits a request for the transfer described by the arguments,
+   as for disk_submit(), and waits for it to complete. */
+static void
+transfer (struct disk *d, disk_sector_t sec_no, size_t cnt,
+          void *buffer, bool write, enum disk_class class) 
+{
+  struct disk_request r;
+  struct semaphore done;
+
+  ASSERT (!intr_context ());
+
+  if (cnt == 0)
+    return;
+  r.disk = d;
+  r.sec_no = sec_no;
+  r.cnt = cnt;
+  r.write = write;
+  r.class = class;
+  r.buffer = buffer;
+  r.buffers = NULL;
+  r.complete = disk_complete_sema;
+  r.aux = &done;
+  sema_init (&done, 0);
+  disk_submit (&r);
+  sema_down (&done);
+}
+
+/* Queues R, which the caller has filled in, on its disk's
+   channel, to be carried out in the order start_request() picks.
+   Returns at once.  When the transfer is done, R->complete(R) is
+   called in interrupt context, so it must not sleep; until then R
+   and its buffers must stay put.  May be called from interrupt
+   context. */
+void
+disk_submit (struct disk_request *r) 
+{
+  struct disk *d = r->disk;
+  enum intr_level old_level;
+
+  ASSERT (d != NULL);
+  ASSERT (r->buffer != NULL || r->buffers != NULL);
+  ASSERT (r->complete != NULL);
+  ASSERT (r->cnt > 0);
+  ASSERT (r->cnt <= d->capacity && r->sec_no <= d->capacity - r->cnt);
+  ASSERT (r->class < DISK_CLASS_CNT);
+
+  r->done = 0;
+  r->submitted = timer_ticks ();
+  old_level = intr_disable ();
+  r->submit_tsc = rdtsc ();
+  d->stats.depth_sum += d->stats.depth;
+  if (++d->stats.depth > d->stats.depth_max)
+    d->stats.depth_max = d->stats.depth;
+  if (d->ram != NULL)
+    ram_transfer (r);
+  else if (d->virtio) 
+    {
+      list_push_back (&virtio_pending, &r->elem);
+      virtio_start ();
+    }
+  else 
+    {
+      ASSERT (!conflicts_queued (d->channel, r));
+      list_push_back (&d->channel->queue, &r->elem);
+      start_request (d->channel);
+    }
+  intr_set_level (old_level);
+}
+
+/* Returns true if requests A and B are for overlapping sectors of
+   the same disk and at least one of them writes. */
+static bool
+requests_conflict (const struct disk_request *a,
+                   const struct disk_request *b) 
+{
+  return (a->disk == b->disk && (a->write || b->write)
+          && a->sec_no < b->sec_no + b->cnt
+          && b->sec_no < a->sec_no + a->cnt);
+}
+
+/* Returns true if R conflicts with a request queued on channel C
+   or part of its command in progress.  start_request() may carry
+   them out in either order.  Interrupts must be off. */
+static bool
+conflicts_queued (struct channel *c, const struct disk_request *r) 
+{
+  struct list_elem *e;
+  size_t i;
+
+  for (i = 0; i < c->cmd_req_cnt; i++)
+    if (requests_conflict (c->cmd_reqs[i], r))
+      return true;
+  for (e = list_begin (&c->queue); e != list_end (&c->queue);
+       e = list_next (e))
+    if (requests_conflict (list_entry (e, struct disk_request, elem), r))
+      return true;
+  return false;
+}
+
+/* Carries out request R on its RAM disk at once.  Interrupts
+   must be off, as they would be for a completion from the
+   interrupt handler. */
+static void
+ram_transfer (struct disk_request *r) 
+{
+  struct disk *d = r->disk;
+  size_t i;
+
+  r->start_tsc = rdtsc ();
+  for (i = 0; i < r->cnt; i++) 
+    {
+      uint8_t *sector = d->ram + (r->sec_no + i) * DISK_SECTOR_SIZE;
+      if (r->write)
+        memcpy (sector, sector_buffer (r, i), DISK_SECTOR_SIZE);
+      else
+        memcpy (sector_buffer (r, i), sector, DISK_SECTOR_SIZE);
+    }
+  if (r->write)
+    d->stats.write_cnt += r->cnt;
+  else
+    d->stats.read_cnt += r->cnt;
+  d->stats.command_cnt++;
+  r->done = r->cnt;
+  account_request (r);
+  r->complete (r);
+}
+
+/* Hands the pending virtio requests to the device, oldest first,
+   until it runs out of room.  Interrupts must be off. */
+static void
+virtio_start (void) 
+{
+  while (!list_empty (&virtio_pending)) 
+    {
+      struct disk_request *r = list_entry (list_front (&virtio_pending),
+                                           struct disk_request, elem);
+      r->start_tsc = rdtsc ();
+      if (!virtio_blk_submit (r))
+        break;
+      list_pop_front (&virtio_pending);
+      virtio_disk.stats.command_cnt++;
+    }
+}
+
+/* Completes request R, which the virtio block device has carried
+   out, and passes it more work.  Called in interrupt context. */
+static void
+virtio_done (struct disk_request *r) 
+{
+  if (r->write)
+    virtio_disk.stats.write_cnt += r->cnt;
+  else
+    virtio_disk.stats.read_cnt += r->cnt;
+  r->done = r->cnt;
+  account_request (r);
+  r->complete (r);
+  virtio_start ();
+}
+
+/* A disk_request completion function that ups the semaphore
+   R->aux. */
+void
+disk_complete_sema (struct disk_request *r) 
+{
+  sema_up (r->aux);
+}
+
+/* Returns the C-LOOK sort key of sector SEC_NO of disk D: the
+   sectors of a channel's master sort before its slave's. */
+static uint32_t
+sort_key (const struct disk *d, disk_sector_t sec_no) 
+{
+  return ((uint32_t) d->dev_no << 28) | sec_no;
+}
+
+/* Picks the next request to start from channel C's queue: the
+   oldest if it has waited DEADLINE_TICKS, otherwise the first at
+   or after the end of the last command in sector order, wrapping
+   around to the lowest sector (C-LOOK).  DISK_WRITE_BEHIND requests
+   are only considered when nothing else is queued, so a flush
+   never holds up a reader for more than the command in progress,
+   but the deadline still keeps them from starving.  Queue must not
+   be empty. */
+static struct disk_request *
+pick_request (struct channel *c) 
+{
+  struct disk_request *oldest, *next = NULL, *lowest = NULL;
+  struct list_elem *e;
+  bool foreground = false;
+
+  oldest = list_entry (list_front (&c->queue), struct disk_request, elem);
+  if (timer_elapsed (oldest->submitted) >= DEADLINE_TICKS)
+    return oldest;
+
+  for (e = list_begin (&c->queue); e != list_end (&c->queue);
+       e = list_next (e))
+    if (list_entry (e, struct disk_request, elem)->class
+        != DISK_WRITE_BEHIND)
+      {
+        foreground = true;
+        break;
+      }
+
+  for (e = list_begin (&c->queue); e != list_end (&c->queue);
+       e = list_next (e)) 
+    {
+      struct disk_request *r = list_entry (e, struct disk_request, elem);
+      uint32_t key = sort_key (r->disk, r->sec_no);
+
+      if (foreground && r->class == DISK_WRITE_BEHIND)
+        continue;
+      if (lowest == NULL || key < sort_key (lowest->disk, lowest->sec_no))
+        lowest = r;
+      if (key >= c->head
+          && (next == NULL || key < sort_key (next->disk, next->sec_no)))
+        next = r;
+    }
+  return next != NULL ? next : lowest;
+}
+
+/* Looks in channel C's queue for a request that can join the
+   command being built: same disk and direction, starting right
+   after the command's sectors (if BACK) or ending right before
+   them, and small enough.  Removes and returns it, or returns a
+   null pointer. */
+static struct disk_request *
+take_mergeable (struct channel *c, bool back) 
+{
+  struct list_elem *e;
+
+  if (c->cmd_req_cnt >= MERGE_MAX)
+    return NULL;
+  for (e = list_begin (&c->queue); e != list_end (&c->queue);
+       e = list_next (e)) 
+    {
+      struct disk_request *r = list_entry (e, struct disk_request, elem);
+
+      if (r->disk == c->cmd_disk && r->write == c->cmd_write
+          && c->cmd_cnt + r->cnt <= NSECT_MAX
+          && (back ? r->sec_no == c->cmd_sec + c->cmd_cnt
+              : r->sec_no + r->cnt == c->cmd_sec)) 
+        {
+          list_remove (&r->elem);
+          return r;
+        }
+    }
+  return NULL;
+}
+
+/* Starts the next command on channel C, if C is idle.  The
+   command is the request pick_request() chooses, or up to its
+   first NSECT_MAX sectors, merged with any queued requests for
+   the sectors just before or after it.  Interrupts must be off.
+
+   Requests may be carried out in a different order than they
+   were submitted, so callers must not have a write in flight
+   together with any other request for the same sector.
+   disk_submit() asserts this.  The buffer cache keeps an entry
+   locked, and hashed under its sector, while it is read or
+   written.  Swap publishes a slot for read-around only once the
+   slot's write is done. */
+static void
+start_request (struct channel *c) 
+{
+  struct disk_request *r;
+  size_t left, i;
+
+  ASSERT (intr_get_level () == INTR_OFF);
+
+  if (c->cmd_req_cnt > 0 || list_empty (&c->queue))
+    return;
+
+  r = pick_request (c);
+  list_remove (&r->elem);
+  left = r->cnt - r->done;
+  r->chunk = left < NSECT_MAX ? left : NSECT_MAX;
+  c->cmd_reqs[0] = r;
+  c->cmd_req_cnt = 1;
+  c->cmd_disk = r->disk;
+  c->cmd_write = r->write;
+  c->cmd_sec = r->sec_no + r->done;
+  c->cmd_cnt = r->chunk;
+
+  /* Merge whole requests for adjacent sectors into the command. */
+  if (r->chunk == r->cnt)
+    for (;;) 
+      {
+        struct disk_request *m = take_mergeable (c, true);
+        if (m != NULL)
+          c->cmd_reqs[c->cmd_req_cnt++] = m;
+        else if ((m = take_mergeable (c, false)) != NULL) 
+          {
+            for (i = c->cmd_req_cnt; i > 0; i--)
+              c->cmd_reqs[i] = c->cmd_reqs[i - 1];
+            c->cmd_reqs[0] = m;
+            c->cmd_req_cnt++;
+            c->cmd_sec = m->sec_no;
+          }
+        else
+          break;
+        m->chunk = m->cnt;
+        c->cmd_cnt += m->cnt;
+        c->cmd_disk->stats.merge_cnt++;
+      }
+
+  start_command (c);
+}
+
+/* Returns the buffer for sector I of request R. */
+static void *
+sector_buffer (const struct disk_request *r, size_t i) 
+{
+  return (r->buffers != NULL ? r->buffers[i]
+          : (uint8_t *) r->buffer + i * DISK_SECTOR_SIZE);
+}
+
+/* Returns the buffer for sector I of channel C's command. */
+static void *
+command_buffer (const struct channel *c, size_t i) 
+{
+  size_t j;
+
+  for (j = 0; j < c->cmd_req_cnt; j++) 
+    {
+      struct disk_request *r = c->cmd_reqs[j];
+      if (i < r->chunk)
+        return sector_buffer (r, r->done + i);
+      i -= r->chunk;
+    }
+  NOT_REACHED ();
+}
+
+/* Issues channel C's command, set up by start_request().
+   Interrupts must be off. */
+static void
+start_command (struct channel *c) 
+{
+  struct disk *d = c->cmd_disk;
+  uint64_t now = rdtsc ();
+  size_t i;
+
+  for (i = 0; i < c->cmd_req_cnt; i++)
+    if (c->cmd_reqs[i]->done == 0)
+      c->cmd_reqs[i]->start_tsc = now;
+  c->cmd_pos = 0;
+  c->head = sort_key (d, c->cmd_sec + c->cmd_cnt);
+  if (d->use_dma)
+    start_dma (c);
+  else 
+    {
+      uint8_t command;
+
+      if (d->multiple > 0)
+        command = c->cmd_write ? CMD_WRITE_MULTIPLE : CMD_READ_MULTIPLE;
+      else
+        command = (c->cmd_write ? CMD_WRITE_SECTOR_RETRY
+                   : CMD_READ_SECTOR_RETRY);
+      select_sector (d, c->cmd_sec, c->cmd_cnt);
+      issue_pio_command (c, command);
+
+      /* A write asks for its first block right away.  After that
+         the disk interrupts when it wants the next block, and once
+         more when it is done. */
+      if (c->cmd_write)
+        pio_block (c);
+    }
+}
+
+/* Transfers the next block of channel C's PIO command: one
+   sector, or D->multiple sectors with READ/WRITE MULTIPLE. */
+static void
+pio_block (struct channel *c) 
+{
+  struct disk *d = c->cmd_disk;
+  size_t block = d->multiple > 0 ? d->multiple : 1;
+  size_t left = c->cmd_cnt - c->cmd_pos;
+  size_t n = left < block ? left : block;
+  size_t i;
+
+  if (!poll_while_busy (d))
+    PANIC ("%s: disk %s failed, sector=%"PRDSNu, d->name,
+           c->cmd_write ? "write" : "read", c->cmd_sec + c->cmd_pos);
+  for (i = 0; i < n; i++) 
+    {
+      void *sector = command_buffer (c, c->cmd_pos + i);
+      if (c->cmd_write)
+        output_sector (c, sector);
+      else
+        input_sector (c, sector);
+    }
+  c->cmd_pos += n;
+}
+
+/* Advances channel C's command on an interrupt from its disk.
+   If that was the end of it, completes its requests, or issues
+   the next command of a request longer than NSECT_MAX. */
+static void
+advance_request (struct channel *c) 
+{
+  struct disk *d = c->cmd_disk;
+  size_t i;
+
+  if (d->use_dma)
+    finish_dma (c);
+  else if (!c->cmd_write || c->cmd_pos < c->cmd_cnt)
+    {
+      /* A read's block is ready, or a write wants its next block. */
+      pio_block (c);
+      if (c->cmd_write || c->cmd_pos < c->cmd_cnt)
+        return;
+    }
+
+  if (c->cmd_write)
+    d->stats.write_cnt += c->cmd_cnt;
+  else
+    d->stats.read_cnt += c->cmd_cnt;
+  d->stats.command_cnt++;
+  for (i = 0; i < c->cmd_req_cnt; i++)
+    c->cmd_reqs[i]->done += c->cmd_reqs[i]->chunk;
+
+  if (c->cmd_req_cnt == 1 && c->cmd_reqs[0]->done < c->cmd_reqs[0]->cnt) 
+    {
+      struct disk_request *r = c->cmd_reqs[0];
+      size_t left = r->cnt - r->done;
+
+      r->chunk = left < NSECT_MAX ? left : NSECT_MAX;
+      c->cmd_sec = r->sec_no + r->done;
+      c->cmd_cnt = r->chunk;
+      start_command (c);
+    }
+  else 
+    {
+      size_t cnt = c->cmd_req_cnt;
+
+      c->cmd_req_cnt = 0;
+      for (i = 0; i < cnt; i++) 
+        {
+          account_request (c->cmd_reqs[i]);
+          c->cmd_reqs[i]->complete (c->cmd_reqs[i]);
+        }
+      start_request (c);
+    }
+}
+
+/* Adds the SIZE bytes at physical address ADDR to the N
+   descriptors already in PRDT, splitting them at 64 kB boundaries
+   and merging them with the last descriptor if they follow it.
+   Returns the new number of descriptors. */
+static size_t
+add_prd (struct prd *prdt, size_t n, uint32_t addr, uint32_t size) 
+{
+  while (size > 0) 
+    {
+      uint32_t room = 0x10000 - (addr & 0xffff);
+      uint32_t part = size < room ? size : room;
+      struct prd *last = n > 0 ? &prdt[n - 1] : NULL;
+
+      /* The last region ends at ADDR and ADDR is not at a 64 kB
+         boundary, so it can grow without crossing one.  If it grows
+         to 64 kB, its size wraps around to 0 as it should. */
+      if (last != NULL && (addr & 0xffff) != 0
+          && last->addr + last->size == addr)
+        last->size += part;
+      else 
+        {
+          ASSERT (n < PRD_CNT);
+          prdt[n].addr = addr;
+          prdt[n].size = part;
+          prdt[n].flags = 0;
+          n++;
+        }
+      addr += part;
+      size -= part;
+    }
+  return n;
+}
+
+/* Starts channel C's command by DMA: the whole command takes one
+   interrupt. */
+static void
+start_dma (struct channel *c) 
+{
+  uint8_t bm_command = c->cmd_write ? 0 : BM_CMD_READ;
+  size_t n = 0, i;
+
+  for (i = 0; i < c->cmd_cnt; i++)
+    n = add_prd (c->prdt, n, vtop (command_buffer (c, i)), DISK_SECTOR_SIZE);
+  c->prdt[n - 1].flags = PRD_EOT;
+
+  outl (reg_bm_prdt (c), vtop (c->prdt));
+  outb (reg_bm_command (c), bm_command);
+  outb (reg_bm_status (c), BM_STA_ERR | BM_STA_INTR);
+
+  select_sector (c->cmd_disk, c->cmd_sec, c->cmd_cnt);
+  issue_pio_command (c, c->cmd_write ? CMD_WRITE_DMA : CMD_READ_DMA);
+  outb (reg_bm_command (c), bm_command | BM_CMD_START);
+}
+
+/* Stops the DMA engine after channel C's command has interrupted,
+   and checks that the transfer succeeded. */
+static void
+finish_dma (struct channel *c) 
+{
+  struct disk *d = c->cmd_disk;
+  uint8_t bm_status;
+
+  outb (reg_bm_command (c), c->cmd_write ? 0 : BM_CMD_READ);
+  bm_status = inb (reg_bm_status (c));
+  outb (reg_bm_status (c), BM_STA_ERR | BM_STA_INTR);
+  if (poll_while_busy (d) || (inb (reg_status (c)) & STA_ERR) != 0
+      || (bm_status & (BM_STA_ERR | BM_STA_ACTIVE)) != 0)
+    PANIC ("%s: disk %s failed, sector=%"PRDSNu,
+           d->name, c->cmd_write ? "write" : "read", c->cmd_sec);
+  c->cmd_pos = c->cmd_cnt;
+}
+
 /* Disk detection and identification. */
 
 static void print_ata_string (char *string, size_t size);
@@ -386,6 +1319,14 @@ identify_ata_device (struct disk *d)
   /* Calculate capacity. */
   d->capacity = id[60] | ((uint32_t) id[61] << 16);
 
+  /* Bits 7:0 of word 47 are the most sectors the disk can transfer
+     per interrupt with READ/WRITE MULTIPLE, 0 if it has no such
+     commands. */
+  set_multiple_mode (d, id[47] & 0xff);
+
+  /* Bit 8 of word 49 is set if the disk supports DMA. */
+  d->dma_capable = (id[49] & 0x0100) != 0;
+
   /* Print identification message. */
   printf ("%s: detected %'"PRDSNu" sector (", d->name, d->capacity);
   if (d->capacity > 1024 / DISK_SECTOR_SIZE * 1024 * 1024)
@@ -404,6 +1345,29 @@ identify_ata_device (struct disk *d)
   printf ("\"\n");
 }
 
+/* Enables READ/WRITE MULTIPLE on disk D with the largest power
+   of 2 up to MAX and MULTIPLE_MAX sectors per interrupt.  Leaves
+   D->multiple 0 if MAX is less than 2 or the disk rejects it. */
+static void
+set_multiple_mode (struct disk *d, int max) 
+{
+  struct channel *c = d->channel;
+  int cnt;
+
+  for (cnt = 1; cnt * 2 <= max && cnt * 2 <= MULTIPLE_MAX; cnt *= 2)
+    continue;
+  if (cnt < 2)
+    return;
+
+  select_device_wait (d);
+  outb (reg_nsect (c), cnt);
+  issue_pio_command (c, CMD_SET_MULTIPLE_MODE);
+  sema_down (&c->completion_wait);
+  wait_while_busy (d);
+  if ((inb (reg_status (c)) & STA_ERR) == 0)
+    d->multiple = cnt;
+}
+
 /* Prints STRING, which consists of SIZE bytes in a funky format:
    each pair of bytes is in reverse order.  Does not print
    trailing whitespace and/or nulls. */
@@ -426,18 +1390,19 @@ print_ata_string (char *string, size_t size)
 }
 
 /* Selects device D, waiting for it to become ready, and then
-   writes SEC_NO to the disk's sector selection registers.  (We
-   use LBA mode.) */
+   writes SEC_NO and CNT, the number of sectors to transfer, to the
+   disk's sector selection registers.  (We use LBA mode.) */
 static void
-select_sector (struct disk *d, disk_sector_t sec_no) 
+select_sector (struct disk *d, disk_sector_t sec_no, size_t cnt) 
 {
   struct channel *c = d->channel;
 
   ASSERT (sec_no < d->capacity);
   ASSERT (sec_no < (1UL << 28));
+  ASSERT (cnt > 0 && cnt <= NSECT_MAX);
   
   select_device_wait (d);
-  outb (reg_nsect (c), 1);
+  outb (reg_nsect (c), cnt == NSECT_MAX ? 0 : cnt);
   outb (reg_lbal (c), sec_no);
   outb (reg_lbam (c), sec_no >> 8);
   outb (reg_lbah (c), (sec_no >> 16));
@@ -446,14 +1411,12 @@ select_sector (struct disk *d, disk_sector_t sec_no)
 }
 
 /* Writes COMMAND to channel C and prepares for receiving a
-   completion interrupt. */
+   completion interrupt.  While detecting disks, interrupts must
+   be enabled or our semaphore will never be up'd by the
+   completion handler; requests are started with them off. */
 static void
 issue_pio_command (struct channel *c, uint8_t command) 
 {
-  /* Interrupts must be enabled or our semaphore will never be
-     up'd by the completion handler. */
-  ASSERT (intr_get_level () == INTR_ON);
-
   c->expecting_interrupt = true;
   outb (reg_command (c), command);
 }
@@ -476,8 +1439,10 @@ output_sector (struct channel *c, const void *sector)
 
 /* Low-level ATA primitives. */
 
-/* Wait up to 10 seconds for the controller to become idle, that
+/* Wait about 10 ms for the controller to become idle, that
    is, for the BSY and DRQ bits to clear in the status register.
+   Busy-waits, so that requests can be started from interrupt
+   context.
 
    As a side effect, reading the status register clears any
    pending interrupt. */
@@ -486,11 +1451,11 @@ wait_until_idle (const struct disk *d)
 {
   int i;
 
-  for (i = 0; i < 1000; i++) 
+  for (i = 0; i < 25000; i++) 
     {
       if ((inb (reg_status (d->channel)) & (STA_BSY | STA_DRQ)) == 0)
         return;
-      timer_usleep (10);
+      delay_400ns (d->channel);
     }
 
   printf ("%s: idle timeout\n", d->name);
@@ -523,6 +1488,38 @@ wait_while_busy (const struct disk *d)
   return false;
 }
 
+/* Busy-waits about 10 ms for disk D to clear BSY, and then
+   returns the status of the DRQ bit, as wait_while_busy() does.
+   After the disk has interrupted, BSY is normally clear already,
+   so this may be used in interrupt context. */
+static bool
+poll_while_busy (const struct disk *d) 
+{
+  struct channel *c = d->channel;
+  int i;
+
+  for (i = 0; i < 25000; i++)
+    {
+      if (!(inb (reg_alt_status (c)) & STA_BSY))
+        return (inb (reg_alt_status (c)) & STA_DRQ) != 0;
+      delay_400ns (c);
+    }
+
+  printf ("%s: busy timeout\n", d->name);
+  return false;
+}
+
+/* Waits at least 400 ns without sleeping, by reading channel C's
+   alternate status register, which takes at least 100 ns. */
+static void
+delay_400ns (const struct channel *c) 
+{
+  int i;
+
+  for (i = 0; i < 4; i++)
+    inb (reg_alt_status (c));
+}
+
 /* Program D's channel so that D is now the selected disk. */
 static void
 select_device (const struct disk *d)
@@ -533,7 +1530,7 @@ select_device (const struct disk *d)
     dev |= DEV_DEV;
   outb (reg_device (c), dev);
   inb (reg_alt_status (c));
-  timer_nsleep (400);
+  delay_400ns (c);
 }
 
 /* Select disk D in its channel, as select_device(), but wait for
@@ -555,7 +1552,12 @@ interrupt_handler (struct intr_frame *f)
   for (c = channels; c < channels + CHANNEL_CNT; c++)
     if (f->vec_no == c->irq)
       {
-        if (c->expecting_interrupt) 
+        if (c->cmd_req_cnt > 0) 
+          {
+            inb (reg_status (c));               /* Acknowledge interrupt. */
+            advance_request (c);
+          }
+        else if (c->expecting_interrupt) 
           {
             inb (reg_status (c));               /* Acknowledge interrupt. */
             sema_up (&c->completion_wait);      /* Wake up waiter. */
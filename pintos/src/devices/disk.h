@@ -1,7 +1,11 @@
 #ifndef DEVICES_DISK_H
 #define DEVICES_DISK_H
 
+#include <disk-stats.h>
 #include <inttypes.h>
+#include <list.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 /* Size of a disk sector in bytes. */
@@ -15,12 +19,69 @@ typedef uint32_t disk_sector_t;
    printf ("sector=%"PRDSNu"\n", sector); */
 #define PRDSNu PRIu32
 
+struct disk_request;
+
+/* Called when a disk_request completes, in interrupt context. */
+typedef void disk_complete_func (struct disk_request *);
+
+/* A request to transfer CNT sectors starting at SEC_NO between
+   DISK and memory.  Sector SEC_NO + I is at BUFFER + I *
+   DISK_SECTOR_SIZE, or in BUFFERS[I] if BUFFERS is non-null. */
+struct disk_request
+  {
+    struct disk *disk;          /* Disk to transfer to or from. */
+    disk_sector_t sec_no;       /* First sector. */
+    size_t cnt;                 /* Number of sectors. */
+    bool write;                 /* Write to the disk, rather than read? */
+    enum disk_class class;      /* Who it is for, for statistics. */
+    void *buffer;               /* Contiguous buffer... */
+    void *const *buffers;       /* ...or one buffer per sector. */
+    disk_complete_func *complete;       /* Called when done. */
+    void *aux;                  /* For use by COMPLETE. */
+
+    /* Owned by the driver once submitted. */
+    struct list_elem elem;      /* Element in the channel's queue. */
+    int64_t submitted;          /* Timer ticks at disk_submit(). */
+    uint64_t submit_tsc;        /* Time stamp counter at disk_submit(). */
+    uint64_t start_tsc;         /* ...when its first command started. */
+    size_t done;                /* Sectors transferred by past commands. */
+    size_t chunk;               /* Sectors in the current command. */
+  };
+
+/* Use bus-master DMA where possible?  Set by -dma. */
+extern bool disk_dma;
+
+/* What a disk is used for. */
+enum disk_role
+  {
+    DISK_ROLE_FS,               /* The file system. */
+    DISK_ROLE_SWAP,             /* Swap space. */
+    DISK_ROLE_CNT
+  };
+
+/* Size in kB of a RAM disk to use for each role, 0 for none. */
+extern size_t disk_ram_size[DISK_ROLE_CNT];
+
+/* Role to give a virtio block device, if there is one, or
+   DISK_ROLE_CNT for none.  Set by -virtio. */
+extern enum disk_role disk_virtio_role;
+
 void disk_init (void);
 void disk_print_stats (void);
+void disk_get_stats (struct disk *, struct disk_stats *);
 
 struct disk *disk_get (int chan_no, int dev_no);
+struct disk *disk_get_role (enum disk_role);
+struct disk *disk_find (const char *name);
+long long disk_queue_depth (struct disk *);
 disk_sector_t disk_size (struct disk *);
 void disk_read (struct disk *, disk_sector_t, void *);
 void disk_write (struct disk *, disk_sector_t, const void *);
+void disk_read_multiple (struct disk *, disk_sector_t, size_t, void *,
+                         enum disk_class);
+void disk_write_multiple (struct disk *, disk_sector_t, size_t, const void *,
+                          enum disk_class);
+void disk_submit (struct disk_request *);
+void disk_complete_sema (struct disk_request *);
 
 #endif /* devices/disk.h */
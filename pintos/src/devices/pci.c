@@ -0,0 +1,99 @@
+#include "devices/pci.h"
+#include <debug.h>
+#include "threads/io.h"
+
+/* The code in this file accesses PCI configuration space through
+   configuration mechanism #1, which every PC chipset we run on
+   supports.  It is just enough to find a device and program it;
+   there is no resource allocation, we use what the BIOS set up. */
+
+/* Configuration mechanism #1 ports. */
+#define PCI_CONFIG_ADDR 0xcf8   /* Address of the register to access. */
+#define PCI_CONFIG_DATA 0xcfc   /* Data of that register. */
+
+/* Returns the value to write to PCI_CONFIG_ADDR to access register
+   REG of function A.  REG must be a multiple of 4. */
+static uint32_t
+config_addr (const struct pci_addr *a, uint8_t reg) 
+{
+  ASSERT (reg % 4 == 0);
+  ASSERT (a->dev < 32 && a->func < 8);
+
+  return (0x80000000u | ((uint32_t) a->bus << 16) | ((uint32_t) a->dev << 11)
+          | ((uint32_t) a->func << 8) | reg);
+}
+
+/* Returns the 32-bit configuration register REG of function A. */
+uint32_t
+pci_read_config (const struct pci_addr *a, uint8_t reg) 
+{
+  outl (PCI_CONFIG_ADDR, config_addr (a, reg));
+  return inl (PCI_CONFIG_DATA);
+}
+
+/* Writes VALUE to the 32-bit configuration register REG of
+   function A. */
+void
+pci_write_config (const struct pci_addr *a, uint8_t reg, uint32_t value) 
+{
+  outl (PCI_CONFIG_ADDR, config_addr (a, reg));
+  outl (PCI_CONFIG_DATA, value);
+}
+
+/* Scans every PCI function for one for which MATCH(A, AUX)
+   returns true, and stores the first one found in *A.  Returns
+   true if one was found. */
+static bool
+scan (bool (*match) (const struct pci_addr *, uint32_t aux),
+      uint32_t aux, struct pci_addr *a) 
+{
+  int bus, dev, func;
+
+  for (bus = 0; bus < 256; bus++)
+    for (dev = 0; dev < 32; dev++)
+      for (func = 0; func < 8; func++) 
+        {
+          a->bus = bus;
+          a->dev = dev;
+          a->func = func;
+          if ((pci_read_config (a, PCI_REG_ID) & 0xffff) == 0xffff)
+            {
+              /* No function 0 means no device at all. */
+              if (func == 0)
+                break;
+              continue;
+            }
+          if (match (a, aux))
+            return true;
+        }
+  return false;
+}
+
+static bool
+class_match (const struct pci_addr *a, uint32_t class) 
+{
+  return (pci_read_config (a, PCI_REG_CLASS) >> 16) == class;
+}
+
+static bool
+id_match (const struct pci_addr *a, uint32_t id) 
+{
+  return pci_read_config (a, PCI_REG_ID) == id;
+}
+
+/* Finds the first PCI function with the given CLASS and SUBCLASS
+   and stores its location in *A.  Returns true if successful. */
+bool
+pci_find_class (uint8_t class, uint8_t subclass, struct pci_addr *a) 
+{
+  return scan (class_match, ((uint32_t) class << 8) | subclass, a);
+}
+
+/* Finds the first PCI function with the given VENDOR and DEVICE
+   IDs and stores its location in *A.  Returns true if
+   successful. */
+bool
+pci_find_device (uint16_t vendor, uint16_t device, struct pci_addr *a) 
+{
+  return scan (id_match, ((uint32_t) device << 16) | vendor, a);
+}
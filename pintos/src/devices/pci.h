@@ -0,0 +1,32 @@
+#ifndef DEVICES_PCI_H
+#define DEVICES_PCI_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Location of a PCI function. */
+struct pci_addr
+  {
+    uint8_t bus;                /* Bus number, 0...255. */
+    uint8_t dev;                /* Device number, 0...31. */
+    uint8_t func;               /* Function number, 0...7. */
+  };
+
+/* Configuration space registers. */
+#define PCI_REG_ID 0x00         /* Device ID << 16 | vendor ID. */
+#define PCI_REG_COMMAND 0x04    /* Command (16 bits). */
+#define PCI_REG_CLASS 0x08      /* Class << 24 | subclass << 16
+                                   | prog. interface << 8 | rev. */
+#define PCI_REG_BAR0 0x10       /* First of six base address registers. */
+#define PCI_REG_IRQ 0x3c        /* Interrupt line (8 bits). */
+
+/* Command register bits. */
+#define PCI_CMD_IO 0x0001       /* Respond to I/O space accesses. */
+#define PCI_CMD_MASTER 0x0004   /* May act as bus master. */
+
+uint32_t pci_read_config (const struct pci_addr *, uint8_t reg);
+void pci_write_config (const struct pci_addr *, uint8_t reg, uint32_t);
+bool pci_find_class (uint8_t class, uint8_t subclass, struct pci_addr *);
+bool pci_find_device (uint16_t vendor, uint16_t device, struct pci_addr *);
+
+#endif /* devices/pci.h */
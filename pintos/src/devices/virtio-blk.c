@@ -0,0 +1,329 @@
+#include "devices/virtio-blk.h"
+#include <debug.h>
+#include <round.h>
+#include <stdio.h>
+#include <string.h>
+#include "devices/pci.h"
+#include "threads/interrupt.h"
+#include "threads/io.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/vaddr.h"
+
+/* The code in this file drives the first virtio block device
+   through its legacy ("transitional") PCI interface, as described
+   in the virtio 0.9.5 specification.  It uses a single virtqueue
+   and no optional features.  disk.c presents it as an ordinary
+   disk and hands it requests from disk_submit(); as many may be
+   in flight at once as there are descriptors for. */
+
+/* PCI IDs of a legacy virtio block device. */
+#define VIRTIO_VENDOR 0x1af4
+#define VIRTIO_BLK_DEVICE 0x1001
+
+/* Legacy virtio I/O port addresses, relative to BAR0. */
+#define REG_DEVICE_FEATURES 0x00        /* Features offered (32 bits). */
+#define REG_GUEST_FEATURES 0x04         /* Features accepted (32 bits). */
+#define REG_QUEUE_PFN 0x08              /* Queue page frame (32 bits). */
+#define REG_QUEUE_SIZE 0x0c             /* Queue size (16 bits). */
+#define REG_QUEUE_SELECT 0x0e           /* Queue select (16 bits). */
+#define REG_QUEUE_NOTIFY 0x10           /* Queue notify (16 bits). */
+#define REG_STATUS 0x12                 /* Device status (8 bits). */
+#define REG_ISR 0x13                    /* ISR status, cleared on read. */
+#define REG_CAPACITY 0x14               /* Sectors (64 bits). */
+
+/* Device status bits. */
+#define STATUS_ACK 0x01                 /* Guest found the device. */
+#define STATUS_DRIVER 0x02              /* Guest can drive it. */
+#define STATUS_DRIVER_OK 0x04           /* Driver is ready. */
+#define STATUS_FAILED 0x80              /* Guest gave up. */
+
+/* Legacy virtqueues are aligned to, and laid out in, pages of
+   this size. */
+#define VQ_ALIGN 4096
+
+/* A virtqueue descriptor: one buffer of a request. */
+struct vq_desc
+  {
+    uint64_t addr;                      /* Physical address. */
+    uint32_t len;                       /* Length in bytes. */
+    uint16_t flags;                     /* VQ_DESC_* flags. */
+    uint16_t next;                      /* Next descriptor, if NEXT. */
+  };
+#define VQ_DESC_NEXT 1                  /* Another descriptor follows. */
+#define VQ_DESC_WRITE 2                 /* Device writes this buffer. */
+
+/* The ring of requests we make available to the device. */
+struct vq_avail
+  {
+    uint16_t flags;
+    uint16_t idx;                       /* Where we put the next entry. */
+    uint16_t ring[];                    /* Head descriptors. */
+  };
+
+/* The ring of requests the device has used. */
+struct vq_used_elem
+  {
+    uint32_t id;                        /* Head descriptor. */
+    uint32_t len;                       /* Bytes written. */
+  };
+struct vq_used
+  {
+    uint16_t flags;
+    uint16_t idx;                       /* Where the device puts the next. */
+    struct vq_used_elem ring[];
+  };
+
+/* The header that starts each virtio-blk request. */
+struct blk_header
+  {
+    uint32_t type;                      /* BLK_T_IN or BLK_T_OUT. */
+    uint32_t reserved;
+    uint64_t sector;                    /* First sector. */
+  };
+#define BLK_T_IN 0                      /* Read. */
+#define BLK_T_OUT 1                     /* Write. */
+#define BLK_S_OK 0                      /* Status of a successful request. */
+
+/* The device.  Everything below is protected by disabling
+   interrupts. */
+static uint16_t io_base;                /* BAR0. */
+static disk_sector_t capacity;          /* Size in sectors. */
+static virtio_blk_done_func *done_func; /* Completion callback. */
+
+static uint16_t vq_size;                /* Descriptors in the queue. */
+static struct vq_desc *vq_desc;         /* Descriptor table. */
+static struct vq_avail *vq_avail;       /* Available ring. */
+static struct vq_used *vq_used;         /* Used ring. */
+static uint16_t last_used;              /* Used entries seen so far. */
+static uint16_t free_head;              /* First free descriptor. */
+static uint16_t free_cnt;               /* Number of free descriptors. */
+
+/* Per head descriptor: the request it starts, with its header
+   and status byte. */
+static struct disk_request **requests;
+static struct blk_header *headers;
+static uint8_t *statuses;
+
+static void interrupt_handler (struct intr_frame *);
+
+/* Finds a virtio block device and sets it up, to call DONE as
+   each request completes.  Returns true if successful. */
+bool
+virtio_blk_init (virtio_blk_done_func *done) 
+{
+  struct pci_addr a;
+  size_t avail_ofs, used_ofs, vq_bytes, req_bytes, i;
+  uint8_t *vq, *req_mem;
+  uint32_t bar0;
+  int irq;
+
+  if (!pci_find_device (VIRTIO_VENDOR, VIRTIO_BLK_DEVICE, &a))
+    return false;
+  bar0 = pci_read_config (&a, PCI_REG_BAR0);
+  irq = pci_read_config (&a, PCI_REG_IRQ) & 0xff;
+  if ((bar0 & 1) == 0 || irq == 0 || irq >= 16
+      || irq == 2 || irq == 14 || irq == 15)
+    {
+      printf ("virtio-blk: unusable I/O base or irq %d\n", irq);
+      return false;
+    }
+  io_base = bar0 & ~3u;
+  pci_write_config (&a, PCI_REG_COMMAND,
+                    pci_read_config (&a, PCI_REG_COMMAND)
+                    | PCI_CMD_IO | PCI_CMD_MASTER);
+
+  /* Reset, then acknowledge the device.  We take none of the
+     features it offers. */
+  outb (io_base + REG_STATUS, 0);
+  outb (io_base + REG_STATUS, STATUS_ACK | STATUS_DRIVER);
+  inl (io_base + REG_DEVICE_FEATURES);
+  outl (io_base + REG_GUEST_FEATURES, 0);
+
+  /* Lay out queue 0: descriptors and available ring, then the
+     used ring on the next aligned page. */
+  outw (io_base + REG_QUEUE_SELECT, 0);
+  vq_size = inw (io_base + REG_QUEUE_SIZE);
+  if (vq_size < 3)
+    goto fail;
+  avail_ofs = sizeof *vq_desc * vq_size;
+  used_ofs = ROUND_UP (avail_ofs + sizeof *vq_avail
+                       + sizeof (uint16_t) * (vq_size + 1), VQ_ALIGN);
+  vq_bytes = used_ofs + ROUND_UP (sizeof *vq_used + sizeof (uint16_t)
+                                  + sizeof *vq_used->ring * vq_size,
+                                  VQ_ALIGN);
+  req_bytes = (sizeof *requests + sizeof *headers + 1) * vq_size;
+  vq = palloc_get_multiple (PAL_ZERO, DIV_ROUND_UP (vq_bytes, PGSIZE));
+  req_mem = palloc_get_multiple (PAL_ZERO, DIV_ROUND_UP (req_bytes, PGSIZE));
+  if (vq == NULL || req_mem == NULL)
+    goto fail;
+  vq_desc = (struct vq_desc *) vq;
+  vq_avail = (struct vq_avail *) (vq + avail_ofs);
+  vq_used = (struct vq_used *) (vq + used_ofs);
+  headers = (struct blk_header *) req_mem;
+  requests = (struct disk_request **) (headers + vq_size);
+  statuses = (uint8_t *) (requests + vq_size);
+
+  for (i = 0; i < vq_size; i++)
+    vq_desc[i].next = i + 1;
+  free_head = 0;
+  free_cnt = vq_size;
+  last_used = 0;
+  done_func = done;
+
+  capacity = inl (io_base + REG_CAPACITY);
+  if (inl (io_base + REG_CAPACITY + 4) != 0)
+    capacity = (disk_sector_t) -1;
+
+  intr_register_ext (0x20 + irq, interrupt_handler, "virtio-blk");
+  outl (io_base + REG_QUEUE_PFN, vtop (vq) / VQ_ALIGN);
+  outb (io_base + REG_STATUS,
+        STATUS_ACK | STATUS_DRIVER | STATUS_DRIVER_OK);
+  printf ("virtio-blk: %'"PRDSNu" sectors, %"PRIu16" descriptors, irq %d\n",
+          capacity, vq_size, irq);
+  return true;
+
+ fail:
+  outb (io_base + REG_STATUS, STATUS_FAILED);
+  printf ("virtio-blk: initialization failed\n");
+  return false;
+}
+
+/* Returns the size of the device, in sectors. */
+disk_sector_t
+virtio_blk_capacity (void) 
+{
+  return capacity;
+}
+
+/* Returns the buffer for sector I of request R. */
+static uint8_t *
+sector_buffer (const struct disk_request *r, size_t i) 
+{
+  return (r->buffers != NULL ? r->buffers[i]
+          : (uint8_t *) r->buffer + i * DISK_SECTOR_SIZE);
+}
+
+/* Returns the number of pieces of contiguous memory that R's
+   sectors are in. */
+static size_t
+count_segments (const struct disk_request *r) 
+{
+  size_t segs = 1, i;
+
+  for (i = 1; i < r->cnt; i++)
+    if (sector_buffer (r, i) != sector_buffer (r, i - 1) + DISK_SECTOR_SIZE)
+      segs++;
+  return segs;
+}
+
+/* Takes a descriptor off the free list, sets it to describe the
+   LEN bytes at VADDR with FLAGS, and returns its index. */
+static uint16_t
+alloc_desc (const void *vaddr, uint32_t len, uint16_t flags) 
+{
+  uint16_t i = free_head;
+
+  ASSERT (free_cnt > 0);
+  free_head = vq_desc[i].next;
+  free_cnt--;
+  vq_desc[i].addr = vtop (vaddr);
+  vq_desc[i].len = len;
+  vq_desc[i].flags = flags;
+  return i;
+}
+
+/* Hands R to the device.  Returns false, without doing so, if
+   there are not enough free descriptors for it right now.
+   Interrupts must be off. */
+bool
+virtio_blk_submit (struct disk_request *r) 
+{
+  uint16_t head, prev, d;
+  uint16_t data_flags = VQ_DESC_NEXT | (r->write ? 0 : VQ_DESC_WRITE);
+  size_t segs = count_segments (r), i;
+
+  ASSERT (intr_get_level () == INTR_OFF);
+  if (segs + 2 > vq_size)
+    PANIC ("virtio-blk: request of %zu pieces does not fit", segs);
+  if (segs + 2 > free_cnt)
+    return false;
+
+  /* Header, one descriptor per piece of data, status byte. */
+  head = free_head;
+  headers[head].type = r->write ? BLK_T_OUT : BLK_T_IN;
+  headers[head].reserved = 0;
+  headers[head].sector = r->sec_no;
+  statuses[head] = 0xff;
+  requests[head] = r;
+  prev = alloc_desc (&headers[head], sizeof *headers, VQ_DESC_NEXT);
+  for (i = 0; i < r->cnt; ) 
+    {
+      uint8_t *start = sector_buffer (r, i);
+      size_t n = 1;
+
+      while (i + n < r->cnt
+             && sector_buffer (r, i + n) == start + n * DISK_SECTOR_SIZE)
+        n++;
+      d = alloc_desc (start, n * DISK_SECTOR_SIZE, data_flags);
+      vq_desc[prev].next = d;
+      prev = d;
+      i += n;
+    }
+  d = alloc_desc (&statuses[head], 1, VQ_DESC_WRITE);
+  vq_desc[prev].next = d;
+
+  /* Publish the descriptors before the ring entry, and that before
+     the index.  x86 does not reorder stores, so only the compiler
+     needs to be kept in line. */
+  vq_avail->ring[vq_avail->idx % vq_size] = head;
+  barrier ();
+  vq_avail->idx++;
+  barrier ();
+  outw (io_base + REG_QUEUE_NOTIFY, 0);
+  return true;
+}
+
+/* Returns the descriptor chain starting at HEAD to the free
+   list. */
+static void
+free_chain (uint16_t head) 
+{
+  uint16_t i = head;
+
+  for (;;) 
+    {
+      bool more = (vq_desc[i].flags & VQ_DESC_NEXT) != 0;
+      uint16_t next = vq_desc[i].next;
+
+      vq_desc[i].next = free_head;
+      free_head = i;
+      free_cnt++;
+      if (!more)
+        break;
+      i = next;
+    }
+}
+
+/* virtio-blk interrupt handler: completes every request the
+   device has used since the last interrupt. */
+static void
+interrupt_handler (struct intr_frame *f UNUSED) 
+{
+  inb (io_base + REG_ISR);              /* Acknowledge interrupt. */
+  while (last_used != vq_used->idx) 
+    {
+      uint16_t head;
+      struct disk_request *r;
+
+      barrier ();
+      head = vq_used->ring[last_used % vq_size].id;
+      r = requests[head];
+      if (statuses[head] != BLK_S_OK)
+        PANIC ("virtio-blk: %s failed, sector=%"PRDSNu,
+               r->write ? "write" : "read", r->sec_no);
+      free_chain (head);
+      last_used++;
+      done_func (r);
+    }
+}
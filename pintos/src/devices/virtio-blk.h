@@ -0,0 +1,15 @@
+#ifndef DEVICES_VIRTIO_BLK_H
+#define DEVICES_VIRTIO_BLK_H
+
+#include <stdbool.h>
+#include "devices/disk.h"
+
+/* Called, in interrupt context, when the device has carried out
+   a request passed to virtio_blk_submit(). */
+typedef void virtio_blk_done_func (struct disk_request *);
+
+bool virtio_blk_init (virtio_blk_done_func *);
+disk_sector_t virtio_blk_capacity (void);
+bool virtio_blk_submit (struct disk_request *);
+
+#endif /* devices/virtio-blk.h */
@@ -7,169 +7,877 @@
 #include "devices/disk.h"
 #include "threads/thread.h"
 #include "filesys/cache.h"
+#include "filesys/free-map.h"
+#include <debug.h>
+#include <stdio.h>
+#include <string.h>
+#include <round.h>
+#include "threads/palloc.h"
+#include "threads/vaddr.h"
 
 #define TIMER_PERIOD 150
 
-int cache_current_size;
+/* Write-behind pacing.  A periodic pass writes back at most
+   WRITE_BEHIND_BUDGET sectors, as background disk requests that
+   yield to reads and page-ins.  Once more than DIRTY_HIGH_PCT
+   percent of the cache is dirty, write-behind turns urgent: passes
+   come every URGENT_PERIOD ticks, have no budget and compete with
+   foreground I/O, until no more than DIRTY_LOW_PCT percent is. */
+#define WRITE_BEHIND_BUDGET 32
+#define DIRTY_HIGH_PCT 50
+#define DIRTY_LOW_PCT 25
+#define URGENT_PERIOD 10
 
-void cache_init(void){
-    list_init(&buffer_cache_list);
-    lock_init(&buffer_cache_lock);
-    cache_current_size = 0;
-    thread_create("write_behind", PRI_MAX, cache_write_behind, 0);
+/* Longest run of adjacent dirty sectors written back together. */
+#define FLUSH_RUN_MAX 16
+
+/* Most runs of dirty sectors queued on the disk at once. */
+#define FLUSH_DEPTH 4
+
+/* Runs being written back.  cache_write_behind_loop() is also called
+   to sync the file system, so flush_lock serializes its callers. */
+struct flush_run{
+    struct buffer_cache* entries[FLUSH_RUN_MAX];
+    const void* data[FLUSH_RUN_MAX];
+    size_t cnt;
+    struct disk_request req;
+};
+static struct flush_run flush_batch[FLUSH_DEPTH];
+static struct lock flush_lock;
+static struct semaphore flush_done;     /* Up'd as each run is written. */
+
+/* Sector a budgeted write-behind pass starts from, just past where
+   the last one stopped, so that low sectors dirtied again and again
+   cannot starve the rest.  Protected by flush_lock. */
+static disk_sector_t flush_cursor;
+static bool flush_urgent;               /* Dirty ratio went high. */
+
+/* Writes of dirty CACHE_META entries under way outside
+   cache_flush(), in evict_cache() and cache_write_sector().
+   Protected by buffer_cache_lock; meta_written is signaled when the
+   count drops to zero. */
+static size_t meta_writes;
+static struct condition meta_written;
+
+/* Sectors queued for the read_ahead thread.  Read-ahead is only a
+   hint, so requests that do not fit are dropped.  The thread takes
+   up to READ_AHEAD_BATCH queued sectors at a time and reads each run
+   of adjacent ones, up to READ_AHEAD_RUN_MAX long, with one disk
+   request. */
+#define READ_AHEAD_BATCH 32
+#define READ_AHEAD_RUN_MAX 16
+#define READ_AHEAD_QUEUE_SIZE 64
+static disk_sector_t read_ahead_queue[READ_AHEAD_QUEUE_SIZE];
+static size_t read_ahead_head;          /* Next sector to prefetch. */
+static size_t read_ahead_cnt;           /* Number of queued sectors. */
+static struct lock read_ahead_lock;     /* Protects the queue. */
+static struct semaphore read_ahead_sema; /* Up'd once per queued sector. */
+
+/* The read_ahead thread's current batch. */
+static struct buffer_cache* ra_entries[READ_AHEAD_BATCH];
+static void* ra_data[READ_AHEAD_BATCH];
+static size_t ra_cnt;
+static struct disk_request ra_requests[READ_AHEAD_BATCH];
+static size_t ra_req_cnt;
+static struct semaphore ra_done;        /* Up'd as each request is done. */
+
+static void cache_read_ahead_daemon(void* aux);
+
+size_t cache_size = CACHE_SIZE_DEFAULT;
+enum cache_policy cache_policy = CACHE_POLICY_CLOCK;
+
+/* Statistics.  Protected by buffer_cache_lock. */
+static struct cache_stats stats;
+size_t cache_current_size;
+
+/* Both pools are carved from contiguous pages at cache_init().
+   Entry I of cache_pool owns sector buffer I of cache_data_pool, so
+   sector data stays page-aligned and the descriptors that lookups
+   and eviction walk stay packed together. */
+static struct buffer_cache* cache_pool;
+static uint8_t* cache_data_pool;
+
+/* Dirty entries, in the order they were dirtied.  An entry is on
+   this list iff its is_dirty is set.  Protected by buffer_cache_lock. */
+static struct list buffer_cache_dirty_list;
+static size_t buffer_cache_dirty_cnt;   /* Length of the list. */
+
+/* Sector -> buffer_cache index over buffer_cache_list.
+   buffer_cache_list keeps the replacement order, this keeps lookups O(1).
+   Protected by buffer_cache_lock. */
+static struct hash buffer_cache_hash;
+
+/* 2Q state, protected by buffer_cache_lock.  Sectors referenced once
+   go through the A1in FIFO and leave the cache without disturbing Am,
+   the LRU queue (buffer_cache_list) of sectors referenced again after
+   they were evicted from A1in, and of metadata.  A1out remembers the
+   sectors most recently evicted from A1in, but not their data, as
+   ghosts that are hashed by sector like the entries themselves. */
+struct cache_ghost{
+    disk_sector_t sector;
+    struct hash_elem hash_elem;         /* Element in a1out_hash. */
+    struct list_elem elem;              /* Element in a1out or a1out_free. */
+};
+static struct list buffer_cache_a1in;
+static size_t a1in_cnt;                 /* Length of A1in. */
+static size_t a1in_max;                 /* A1in is trimmed above this. */
+static struct list a1out;               /* Ghosts, oldest first. */
+static struct list a1out_free;          /* Unused ghosts. */
+static struct hash a1out_hash;          /* Sector -> ghost in A1out. */
+
+/* Disk request class for sectors of TYPE. */
+static enum disk_class
+cache_disk_class(enum cache_type type){
+    return type == CACHE_META ? DISK_FS_META : DISK_FS_DATA;
 }
 
-struct buffer_cache* find_cache(disk_sector_t sector){
-    
-    struct buffer_cache* cache_e;
+static unsigned
+cache_hash_func(const struct hash_elem* e, void* aux UNUSED){
+    const struct buffer_cache* cache_e = hash_entry(e, struct buffer_cache, hash_elem);
+    return hash_bytes(&cache_e->sector, sizeof cache_e->sector);
+}
+
+static bool
+cache_less_func(const struct hash_elem* a, const struct hash_elem* b, void* aux UNUSED){
+    const struct buffer_cache* cache_a = hash_entry(a, struct buffer_cache, hash_elem);
+    const struct buffer_cache* cache_b = hash_entry(b, struct buffer_cache, hash_elem);
+    return cache_a->sector < cache_b->sector;
+}
+
+static unsigned
+ghost_hash_func(const struct hash_elem* e, void* aux UNUSED){
+    const struct cache_ghost* ghost = hash_entry(e, struct cache_ghost, hash_elem);
+    return hash_bytes(&ghost->sector, sizeof ghost->sector);
+}
+
+static bool
+ghost_less_func(const struct hash_elem* a, const struct hash_elem* b, void* aux UNUSED){
+    const struct cache_ghost* ghost_a = hash_entry(a, struct cache_ghost, hash_elem);
+    const struct cache_ghost* ghost_b = hash_entry(b, struct cache_ghost, hash_elem);
+    return ghost_a->sector < ghost_b->sector;
+}
+
+/* Acquires buffer_cache_lock, accounting for any time spent waiting
+   for it. */
+static void
+cache_lock_acquire(void){
+    if(!lock_try_acquire(&buffer_cache_lock)){
+        int64_t start = timer_ticks();
+        lock_acquire(&buffer_cache_lock);
+        stats.lock_waits += 1;
+        stats.lock_wait_ticks += timer_elapsed(start);
+    }
+}
+
+/* Puts CACHE_E on the dirty list, or takes it off.
+   Needs buffer_cache_lock. */
+static void
+cache_set_dirty(struct buffer_cache* cache_e, bool dirty){
+    if(dirty && !cache_e->is_dirty){
+        list_push_back(&buffer_cache_dirty_list, &cache_e->dirty_elem);
+        buffer_cache_dirty_cnt += 1;
+    }
+    else if(!dirty && cache_e->is_dirty){
+        list_remove(&cache_e->dirty_elem);
+        buffer_cache_dirty_cnt -= 1;
+    }
+    cache_e->is_dirty = dirty;
+}
+
+static bool
+cache_sector_less(const struct list_elem* a, const struct list_elem* b, void* aux UNUSED){
+    const struct buffer_cache* cache_a = list_entry(a, struct buffer_cache, dirty_elem);
+    const struct buffer_cache* cache_b = list_entry(b, struct buffer_cache, dirty_elem);
+    return cache_a->sector < cache_b->sector;
+}
+
+/* Moves CACHE_E to SECTOR_IDX, keeping buffer_cache_hash up to date. */
+static void
+cache_rehash(struct buffer_cache* cache_e, disk_sector_t sector_idx){
+    hash_delete(&buffer_cache_hash, &cache_e->hash_elem);
+    cache_e->sector = sector_idx;
+    hash_insert(&buffer_cache_hash, &cache_e->hash_elem);
+}
+
+/* Sets cache_policy from NAME, "clock" or "2q".  Returns false if
+   NAME is neither. */
+bool cache_policy_parse(const char* name){
+    if(!strcmp(name, "clock")) cache_policy = CACHE_POLICY_CLOCK;
+    else if(!strcmp(name, "2q")) cache_policy = CACHE_POLICY_2Q;
+    else return false;
+    return true;
+}
+
+/* Removes SECTOR from A1out.  Returns true if it was there. */
+static bool
+cache_a1out_take(disk_sector_t sector){
+    struct cache_ghost key;
+    struct hash_elem* e;
+    struct cache_ghost* ghost;
+
+    key.sector = sector;
+    e = hash_delete(&a1out_hash, &key.hash_elem);
+    if(e == NULL) return false;
+    ghost = hash_entry(e, struct cache_ghost, hash_elem);
+    list_remove(&ghost->elem);
+    list_push_back(&a1out_free, &ghost->elem);
+    return true;
+}
+
+/* Remembers SECTOR in A1out, forgetting the oldest if it is full. */
+static void
+cache_a1out_add(disk_sector_t sector){
+    struct cache_ghost* ghost;
+
+    if(list_empty(&a1out_free)){
+        ghost = list_entry(list_pop_front(&a1out), struct cache_ghost, elem);
+        hash_delete(&a1out_hash, &ghost->hash_elem);
+    }
+    else ghost = list_entry(list_pop_front(&a1out_free), struct cache_ghost, elem);
+    ghost->sector = sector;
+    if(hash_insert(&a1out_hash, &ghost->hash_elem) != NULL)
+        list_push_back(&a1out_free, &ghost->elem);  /* Already there. */
+    else list_push_back(&a1out, &ghost->elem);
+}
+
+/* Notes a hit on CACHE_E.  Needs buffer_cache_lock. */
+static void
+cache_policy_touch(struct buffer_cache* cache_e){
+    cache_e->is_used = true;
+    if(cache_policy == CACHE_POLICY_2Q && cache_e->is_hot){
+        list_remove(&cache_e->elem);
+        list_push_back(&buffer_cache_list, &cache_e->elem);
+    }
+    /* Hits in A1in are left alone: a sector read twice in quick
+       succession is no more likely to be needed again later. */
+}
+
+/* Queues CACHE_E, just loaded or reused for a new sector, for
+   replacement.  Needs buffer_cache_lock. */
+static void
+cache_policy_insert(struct buffer_cache* cache_e){
+    bool was_hot = cache_e->is_hot;    /* Which list it is on now. */
+
+    cache_e->is_used = true;
+    if(cache_policy != CACHE_POLICY_2Q) return;
+
+    if(cache_a1out_take(cache_e->sector)){
+        stats.ghost_hits += 1;
+        cache_e->is_hot = true;
+    }
+    else cache_e->is_hot = cache_e->type == CACHE_META;
+    list_remove(&cache_e->elem);
+    if(!was_hot) a1in_cnt -= 1;
+    if(!cache_e->is_hot) a1in_cnt += 1;
+    list_push_back(cache_e->is_hot ? &buffer_cache_list : &buffer_cache_a1in, &cache_e->elem);
+}
+
+/* Notes that CACHE_E is about to be reused for another sector.
+   Needs buffer_cache_lock. */
+static void
+cache_policy_evict(struct buffer_cache* cache_e){
+    if(cache_policy == CACHE_POLICY_2Q && !cache_e->is_hot)
+        cache_a1out_add(cache_e->sector);
+}
+
+/* Returns the least recently queued unpinned entry on LIST, or NULL. */
+static struct buffer_cache*
+cache_oldest_unpinned(struct list* list){
     struct list_elem* e;
-    if(!list_empty(&buffer_cache_list)){
-        for(e=list_begin(&buffer_cache_list); e!=list_end(&buffer_cache_list); e = list_next(e)){
-            cache_e = list_entry(e, struct buffer_cache, elem);
-            if(cache_e->sector == sector) return cache_e;
-        }
+
+    for(e=list_begin(list); e!=list_end(list); e=list_next(e)){
+        struct buffer_cache* cache_e = list_entry(e, struct buffer_cache, elem);
+        if(cache_e->pin_cnt == 0) return cache_e;
     }
     return NULL;
 }
 
-struct buffer_cache* evict_cache(disk_sector_t sector_idx){
-    /* use same method as evict_frame, second-chance algorithm */
-
+/* Picks an unpinned entry to replace, or returns NULL if every entry
+   is pinned.  Needs buffer_cache_lock. */
+static struct buffer_cache*
+cache_policy_victim(void){
+    struct buffer_cache* cache_e = NULL;
     struct list_elem* e;
-    struct buffer_cache* cache_e;
-    if(!list_empty(&buffer_cache_list)){
-        for(e=list_begin(&buffer_cache_list); e!=list_end(&buffer_cache_list); e=list_next(e)){
-            cache_e = list_entry(e, struct buffer_cache, elem);
-            if(cache_e->is_using) continue;
-            if(cache_e->is_used) cache_e->is_used=false;
-            else{ /* selected */
-                if(cache_e->is_dirty) /*write back(write behind) */
-                    disk_write(filesys_disk, cache_e->sector, &cache_e->data);
-                // list_remove(&cache_e->elem); **do not need to remove because we reuse this
-                cache_e->is_using = true;
-                cache_e->sector = sector_idx;
-                disk_read(filesys_disk, cache_e->sector, &cache_e->data);
-                cache_e->is_dirty = false;
-
-                return cache_e;
-            }
-        }
+    int pass;
+
+    if(cache_policy == CACHE_POLICY_2Q){
+        /* Take from A1in while it is over its share, from Am otherwise. */
+        if(a1in_cnt > a1in_max)
+            cache_e = cache_oldest_unpinned(&buffer_cache_a1in);
+        if(cache_e == NULL) cache_e = cache_oldest_unpinned(&buffer_cache_list);
+        if(cache_e == NULL) cache_e = cache_oldest_unpinned(&buffer_cache_a1in);
+        return cache_e;
+    }
+
+    /* use same method as evict_frame, second-chance algorithm */
+    for(pass=0; pass<2; pass++){
         for(e=list_begin(&buffer_cache_list); e!=list_end(&buffer_cache_list); e=list_next(e)){
-            cache_e = list_entry(e, struct buffer_cache, elem);
-            if(cache_e->is_using) continue;
-            if(cache_e->is_used) cache_e->is_used=false;
-            else{ /* selected */
-                if(cache_e->is_dirty) /*write back(write behind) */
-                    disk_write(filesys_disk, cache_e->sector, &cache_e->data);
-                // list_remove(&cache_e->elem); **do not need to remove because we reuse this
-                cache_e->is_using = true;
-                cache_e->sector = sector_idx;
-
-                disk_read(filesys_disk, cache_e->sector, &cache_e->data);
-                cache_e->is_dirty = false;
-
-                return cache_e;
-            }
+            struct buffer_cache* candidate = list_entry(e, struct buffer_cache, elem);
+            if(candidate->pin_cnt > 0) continue;
+            if(candidate->is_used) candidate->is_used=false;
+            else return candidate; /* selected */
         }
     }
-
     return NULL;
 }
 
+void cache_init(void){
+    size_t pool_pages = DIV_ROUND_UP(cache_size * sizeof *cache_pool, PGSIZE);
+    size_t data_pages = DIV_ROUND_UP(cache_size * DISK_SECTOR_SIZE, PGSIZE);
+
+    ASSERT(cache_size > 0);
+    cache_pool = palloc_get_multiple(PAL_ZERO, pool_pages);
+    cache_data_pool = palloc_get_multiple(0, data_pages);
+    if(cache_pool == NULL || cache_data_pool == NULL)
+        PANIC("not enough memory for a %zu entry buffer cache", cache_size);
+
+    list_init(&buffer_cache_list);
+    list_init(&buffer_cache_dirty_list);
+    list_init(&buffer_cache_a1in);
+    if(cache_policy == CACHE_POLICY_2Q){
+        /* The sizes suggested by the 2Q paper: A1in gets a quarter of
+           the cache and A1out remembers half as many sectors. */
+        size_t a1out_max = cache_size / 2 > 0 ? cache_size / 2 : 1;
+        struct cache_ghost* ghosts;
+        size_t i;
+
+        a1in_max = cache_size / 4 > 0 ? cache_size / 4 : 1;
+        ghosts = palloc_get_multiple(0, DIV_ROUND_UP(a1out_max * sizeof *ghosts, PGSIZE));
+        if(ghosts == NULL || !hash_init(&a1out_hash, ghost_hash_func, ghost_less_func, NULL))
+            PANIC("not enough memory for the buffer cache A1out queue");
+        list_init(&a1out);
+        list_init(&a1out_free);
+        for(i=0; i<a1out_max; i++)
+            list_push_back(&a1out_free, &ghosts[i].elem);
+    }
+    if(!hash_init(&buffer_cache_hash, cache_hash_func, cache_less_func, NULL))
+        PANIC("buffer cache hash creation failed");
+    lock_init(&buffer_cache_lock);
+    cond_init(&buffer_cache_unpinned);
+    cond_init(&meta_written);
+    cache_current_size = 0;
+    lock_init(&read_ahead_lock);
+    sema_init(&read_ahead_sema, 0);
+    sema_init(&ra_done, 0);
+    lock_init(&flush_lock);
+    sema_init(&flush_done, 0);
+    read_ahead_head = read_ahead_cnt = 0;
+    /* Runs at the same priority as other threads: it holds file system
+       locks while it works.  Its disk requests are what yield. */
+    thread_create("write_behind", PRI_DEFAULT, cache_write_behind, 0);
+    thread_create("read_ahead", PRI_DEFAULT, cache_read_ahead_daemon, 0);
+}
+
+struct buffer_cache* find_cache(disk_sector_t sector){
+    /* Only called with buffer_cache_lock held, so one key will do
+       and we keep a whole cache entry off the kernel stack. */
+    static struct buffer_cache key;
+    struct hash_elem* e;
+
+    key.sector = sector;
+    e = hash_find(&buffer_cache_hash, &key.hash_elem);
+    return e != NULL ? hash_entry(e, struct buffer_cache, hash_elem) : NULL;
+}
+
+/* Pins CACHE_E and locks it.  CACHE_E must be unpinned, so its lock
+   is free and this never sleeps while buffer_cache_lock is held. */
+static void
+cache_pin_victim(struct buffer_cache* cache_e){
+    ASSERT(cache_e->pin_cnt == 0);
+    cache_e->pin_cnt = 1;
+    lock_acquire(&cache_e->lock);
+}
+
+/* Drops one pin on CACHE_E.  Needs buffer_cache_lock. */
+static void
+cache_unpin(struct buffer_cache* cache_e){
+    ASSERT(cache_e->pin_cnt > 0);
+    if(--cache_e->pin_cnt == 0)
+        cond_broadcast(&buffer_cache_unpinned, &buffer_cache_lock);
+}
+
+/* Ends a write counted in meta_writes.  Needs buffer_cache_lock. */
+static void
+cache_meta_write_done(void){
+    ASSERT(meta_writes > 0);
+    if(--meta_writes == 0)
+        cond_broadcast(&meta_written, &buffer_cache_lock);
+}
+
+/* Picks an entry to hold SECTOR_IDX.  Called with buffer_cache_lock
+   held, which may be dropped while a dirty victim is written back.
+   Returns the victim pinned, locked and rehashed to SECTOR_IDX, but
+   with stale data, or NULL if the caller has to look SECTOR_IDX up
+   again because the victim or SECTOR_IDX was claimed meanwhile.
+   If every entry is pinned, waits for one to be released first if
+   MAY_WAIT, otherwise returns NULL at once. */
+struct buffer_cache* evict_cache(disk_sector_t sector_idx, bool may_wait){
+    struct buffer_cache* cache_e = cache_policy_victim();
+
+    if(cache_e == NULL){
+        /* every entry is in use, wait for one to be released */
+        if(may_wait) cond_wait(&buffer_cache_unpinned, &buffer_cache_lock);
+        return NULL;
+    }
+
+    cache_pin_victim(cache_e);
+    if(cache_e->is_dirty){ /*write back(write behind) */
+        bool meta = cache_e->type == CACHE_META;
+
+        /* Stay hashed under the old sector while writing it, so its
+           readers wait for us instead of reading stale disk data. */
+        cache_set_dirty(cache_e, false);
+        stats.type[cache_e->type].dirty_evictions += 1;
+        if(meta) meta_writes += 1;
+        lock_release(&buffer_cache_lock);
+        if(meta) free_map_flush();
+        disk_write_multiple(filesys_disk, cache_e->sector, 1, cache_e->data,
+                            cache_disk_class(cache_e->type));
+        cache_lock_acquire();
+        if(meta) cache_meta_write_done();
+
+        if(cache_e->pin_cnt > 1 || find_cache(sector_idx) != NULL){
+            lock_release(&cache_e->lock);
+            cache_unpin(cache_e);
+            return NULL;
+        }
+    }
+    // list_remove(&cache_e->elem); **do not need to remove because we reuse this
+    stats.type[cache_e->type].evictions += 1;
+    cache_policy_evict(cache_e);
+    cache_rehash(cache_e, sector_idx);
+    return cache_e;
+}
+
+/* Takes the next unused entry from the pool for SECTOR_IDX.  Called
+   with buffer_cache_lock held and cache_current_size < cache_size.
+   Returns it pinned and locked, with its data not yet read. */
 struct buffer_cache* allocate_new_cache(disk_sector_t sector_idx){
 
-    struct buffer_cache* new_cache_e = malloc(sizeof(struct buffer_cache));
-    if(new_cache_e == NULL) ASSERT(0);
+    struct buffer_cache* new_cache_e = &cache_pool[cache_current_size];
+    ASSERT(cache_current_size < cache_size);
+    new_cache_e->data = cache_data_pool + cache_current_size * DISK_SECTOR_SIZE;
     list_push_back(&buffer_cache_list, &new_cache_e->elem);
     cache_current_size += 1;
     new_cache_e->sector = sector_idx;
+    hash_insert(&buffer_cache_hash, &new_cache_e->hash_elem);
     new_cache_e->is_used = true;
+    new_cache_e->is_hot = true;
     new_cache_e->is_dirty = false;
+    new_cache_e->is_loading = false;
+    new_cache_e->pin_cnt = 0;
+    lock_init(&new_cache_e->lock);
 
-    new_cache_e->is_using = true;
-
-    disk_read(filesys_disk, sector_idx, new_cache_e->data);
-    new_cache_e->is_using = false;
-
+    cache_pin_victim(new_cache_e);
     return new_cache_e;
 }
 
-void cache_read(disk_sector_t sector_idx, uint8_t* buffer, off_t bytes_read, int sector_ofs, int chunk_size){
-    lock_acquire(&buffer_cache_lock);
-    struct buffer_cache* cache_e = find_cache(sector_idx);
-    if(cache_e == NULL){
-        if(cache_current_size < MAX_CACHE_SIZE) cache_e = allocate_new_cache(sector_idx);
-        else cache_e = evict_cache(sector_idx);
-        ASSERT(cache_e != NULL);
-        
-        cache_e->is_using = true; /* need eviction */
-        lock_release(&buffer_cache_lock);
-        memcpy(buffer+bytes_read, (uint8_t* )&cache_e->data + sector_ofs, chunk_size);
-        cache_e->is_using = false;
+/* Returns the cache entry for SECTOR_IDX, pinned and locked by the
+   current thread, reading the sector from disk on a miss unless
+   BLANK, in which case the caller overwrites all of it.  TYPE says
+   what the sector holds.
+   buffer_cache_lock is never held across disk I/O: hits on other
+   sectors proceed meanwhile, and threads that want the sector being
+   loaded sleep on its lock until it arrives. */
+static struct buffer_cache*
+cache_lookup(disk_sector_t sector_idx, enum cache_type type, bool blank){
+    struct buffer_cache* cache_e;
+
+    cache_lock_acquire();
+    while(1){
+        cache_e = find_cache(sector_idx);
+        if(cache_e != NULL){
+            if(cache_e->is_loading) stats.type[type].load_waits += 1;
+            else stats.type[type].hits += 1;
+            cache_e->type = type;
+            cache_policy_touch(cache_e);
+            cache_e->pin_cnt += 1;
+            lock_release(&buffer_cache_lock);
+            lock_acquire(&cache_e->lock);
+            return cache_e;
+        }
+
+        if(cache_current_size < cache_size) cache_e = allocate_new_cache(sector_idx);
+        else cache_e = evict_cache(sector_idx, true); /* need eviction */
+        if(cache_e != NULL) break;
     }
-    else{
-        cache_e->is_used = true;
-        cache_e->is_using = true; /* need eviction */
+    stats.type[type].misses += 1;
+    if(blank) stats.blank_loads += 1;
+    cache_e->type = type;
+    cache_e->is_loading = !blank;
+    cache_policy_insert(cache_e);
+    lock_release(&buffer_cache_lock);
+
+    if(!blank){
+        disk_read_multiple(filesys_disk, sector_idx, 1, cache_e->data, cache_disk_class(type));
+        cache_lock_acquire();
+        cache_e->is_loading = false;
         lock_release(&buffer_cache_lock);
-        memcpy(buffer+bytes_read, (uint8_t* )&cache_e->data + sector_ofs, chunk_size);
-        cache_e->is_using = false;
     }
+    return cache_e;
+}
 
-    return;
+/* Returns the cache entry for SECTOR_IDX, which holds TYPE data,
+   pinned and locked by the current thread.  The caller may read and
+   modify its data in place and must hand it back with cache_put()
+   before getting another entry. */
+struct buffer_cache*
+cache_get(disk_sector_t sector_idx, enum cache_type type){
+    return cache_lookup(sector_idx, type, false);
 }
 
-void cache_write(disk_sector_t sector_idx, uint8_t* buffer, off_t bytes_read, int sector_ofs, int chunk_size){
-    lock_acquire(&buffer_cache_lock);
-    struct buffer_cache* cache_e = find_cache(sector_idx);
-    if(cache_e == NULL){
-        if (cache_current_size < MAX_CACHE_SIZE) cache_e = allocate_new_cache(sector_idx);
-        else cache_e = evict_cache(sector_idx); /* need eviction */
-        ASSERT(cache_e != NULL);
+/* Like cache_get(), but for a caller that overwrites the whole
+   sector: on a miss the entry's data is garbage rather than read
+   from disk.  The caller must fill it and put it back dirty. */
+struct buffer_cache*
+cache_get_blank(disk_sector_t sector_idx, enum cache_type type){
+    return cache_lookup(sector_idx, type, true);
+}
 
-        cache_e->is_using = true;
-        lock_release(&buffer_cache_lock);
-        memcpy((uint8_t* )&cache_e->data + sector_ofs, buffer+bytes_read, chunk_size);
-        cache_e->is_using = false;
-        cache_e->is_dirty = true;
+/* Unlocks and unpins CACHE_E, obtained from cache_get().
+   DIRTY says whether the caller modified its data. */
+void
+cache_put(struct buffer_cache* cache_e, bool dirty){
+    lock_release(&cache_e->lock);
+    cache_lock_acquire();
+    if(dirty) cache_set_dirty(cache_e, true);
+    cache_unpin(cache_e);
+    lock_release(&buffer_cache_lock);
+}
+
+void cache_read(disk_sector_t sector_idx, uint8_t* buffer, off_t bytes_read, int sector_ofs, int chunk_size, enum cache_type type){
+    struct buffer_cache* cache_e = cache_get(sector_idx, type);
+    memcpy(buffer+bytes_read, cache_e->data + sector_ofs, chunk_size);
+    cache_put(cache_e, false);
+}
+
+void cache_write(disk_sector_t sector_idx, uint8_t* buffer, off_t bytes_read, int sector_ofs, int chunk_size, enum cache_type type){
+    /* A full sector need not be read just to be overwritten. */
+    struct buffer_cache* cache_e = sector_ofs == 0 && chunk_size == DISK_SECTOR_SIZE
+                                   ? cache_get_blank(sector_idx, type)
+                                   : cache_get(sector_idx, type);
+    memcpy(cache_e->data + sector_ofs, buffer+bytes_read, chunk_size);
+    cache_put(cache_e, true);
+}
+
+/* Submits a write of RUN's entries, which hold adjacent sectors in
+   ascending order and are pinned and locked by the caller, as one
+   disk request, in the background unless URGENT.  The caller
+   unlocks them once flush_done says the request is done. */
+static void
+cache_flush_submit(struct flush_run* run, bool urgent){
+    size_t i;
+
+    for(i=0; i<run->cnt; i++)
+        run->data[i] = run->entries[i]->data;
+    run->req.disk = filesys_disk;
+    run->req.sec_no = run->entries[0]->sector;
+    run->req.cnt = run->cnt;
+    run->req.write = true;
+    /* A run of both kinds is charged to its first sector's. */
+    run->req.class = urgent ? cache_disk_class(run->entries[0]->type)
+                            : DISK_WRITE_BEHIND;
+    run->req.buffer = NULL;
+    run->req.buffers = (void* const*) run->data;
+    run->req.complete = disk_complete_sema;
+    run->req.aux = &flush_done;
+    disk_submit(&run->req);
+}
+
+/* Writes back up to BUDGET of the entries that are dirty when
+   called, only CACHE_META ones if META_ONLY, in ascending sector
+   order from flush_cursor, wrapping around, as runs of adjacent
+   sectors.  Up to FLUSH_DEPTH runs are queued on the disk at once,
+   as foreground requests if URGENT, and buffer_cache_lock is
+   dropped while they are written.  The free map is flushed before
+   any run that holds metadata.  Entries dirtied meanwhile are
+   appended to the dirty list and left for the next pass.  Needs
+   flush_lock. */
+static void
+cache_flush(size_t budget, bool urgent, bool meta_only){
+    struct list aside;
+    struct list_elem* e;
+    size_t left, nruns, r, i;
+    bool meta;
+
+    ASSERT(lock_held_by_current_thread(&flush_lock));
+    list_init(&aside);
+    cache_lock_acquire();
+    if(meta_only){
+        /* Set the other entries aside, still dirty, until the end. */
+        for(e = list_begin(&buffer_cache_dirty_list); e != list_end(&buffer_cache_dirty_list); ){
+            struct buffer_cache* cache_e = list_entry(e, struct buffer_cache, dirty_elem);
+
+            e = list_next(e);
+            if(cache_e->type != CACHE_META){
+                list_remove(&cache_e->dirty_elem);
+                list_push_back(&aside, &cache_e->dirty_elem);
+            }
+        }
     }
-    else{
-        cache_e->is_used = true;
-        cache_e->is_using = true;
+    list_sort(&buffer_cache_dirty_list, cache_sector_less, NULL);
+    for(e = list_begin(&buffer_cache_dirty_list); e != list_end(&buffer_cache_dirty_list); e = list_next(e))
+        if(list_entry(e, struct buffer_cache, dirty_elem)->sector >= flush_cursor) break;
+    if(e != list_begin(&buffer_cache_dirty_list) && e != list_end(&buffer_cache_dirty_list))
+        list_splice(list_end(&buffer_cache_dirty_list), list_begin(&buffer_cache_dirty_list), e);
+    left = buffer_cache_dirty_cnt < budget ? buffer_cache_dirty_cnt : budget;
+
+    while(left > 0 && !list_empty(&buffer_cache_dirty_list)){
+        /* Take the next runs of adjacent sectors off the list. */
+        meta = false;
+        for(nruns=0; nruns<FLUSH_DEPTH && left>0 && !list_empty(&buffer_cache_dirty_list); nruns++){
+            struct flush_run* run = &flush_batch[nruns];
+
+            run->cnt = 0;
+            do{
+                struct buffer_cache* cache_e = list_entry(list_front(&buffer_cache_dirty_list),
+                                                          struct buffer_cache, dirty_elem);
+                if(run->cnt > 0 && cache_e->sector != run->entries[run->cnt-1]->sector + 1) break;
+                cache_set_dirty(cache_e, false);
+                cache_e->pin_cnt += 1;
+                if(cache_e->type == CACHE_META) meta = true;
+                run->entries[run->cnt++] = cache_e;
+                left -= 1;
+            } while(left > 0 && run->cnt < FLUSH_RUN_MAX && !list_empty(&buffer_cache_dirty_list));
+        }
+        flush_cursor = flush_batch[nruns-1].entries[flush_batch[nruns-1].cnt-1]->sector + 1;
         lock_release(&buffer_cache_lock);
-        memcpy((uint8_t* )&cache_e->data + sector_ofs, buffer+bytes_read, chunk_size);
-        cache_e->is_using = false;
-        cache_e->is_dirty = true;
+
+        /* Locked first, so no allocation can reach the metadata
+           after the free map is flushed. */
+        for(r=0; r<nruns; r++)
+            for(i=0; i<flush_batch[r].cnt; i++) lock_acquire(&flush_batch[r].entries[i]->lock);
+        if(meta) free_map_flush();
+        for(r=0; r<nruns; r++) cache_flush_submit(&flush_batch[r], urgent);
+        for(r=0; r<nruns; r++) sema_down(&flush_done);
+        for(r=0; r<nruns; r++)
+            for(i=0; i<flush_batch[r].cnt; i++) lock_release(&flush_batch[r].entries[i]->lock);
+
+        cache_lock_acquire();
+        for(r=0; r<nruns; r++){
+            struct flush_run* run = &flush_batch[r];
+
+            stats.flush_runs += 1;
+            for(i=0; i<run->cnt; i++){
+                stats.type[run->entries[i]->type].flushes += 1;
+                cache_unpin(run->entries[i]);
+            }
+        }
     }
+    list_splice(list_end(&buffer_cache_dirty_list), list_begin(&aside), list_end(&aside));
+    lock_release(&buffer_cache_lock);
+}
 
-    return;
+/* Frees the sectors released since the last call once the metadata
+   that dropped them is on disk: writes back every dirty CACHE_META
+   entry, and waits for writes of them already under way, before
+   free_map_end_release() frees the sectors.  Needs flush_lock. */
+static void
+cache_commit_releases(bool urgent){
+    if(!free_map_begin_release()) return;
+    cache_flush((size_t) -1, urgent, true);
+    cache_lock_acquire();
+    while(meta_writes > 0) cond_wait(&meta_written, &buffer_cache_lock);
+    lock_release(&buffer_cache_lock);
+    free_map_end_release();
 }
 
-void cache_write_behind_loop(void){
-    struct list_elem* e;
+/* Does one write-behind pass: commits releases, then writes back
+   the free map and up to BUDGET dirty entries as cache_flush()
+   does. */
+static void
+cache_write_back(size_t budget, bool urgent){
+    lock_acquire(&flush_lock);
+    cache_commit_releases(urgent);
+    free_map_flush();
+    cache_flush(budget, urgent, false);
+    lock_release(&flush_lock);
+}
+
+/* Writes SECTOR_IDX back at once if it is cached and dirty, for
+   callers that need it on disk before the dirty sectors that the
+   next write-behind pass will write. */
+void cache_write_sector(disk_sector_t sector_idx){
     struct buffer_cache* cache_e;
-    lock_acquire(&buffer_cache_lock);
+    bool dirty, meta;
 
-    if(!list_empty(&buffer_cache_list)){
-        for(e=list_begin(&buffer_cache_list); e!=list_end(&buffer_cache_list); e=list_next(e)){
-            cache_e = list_entry(e, struct buffer_cache, elem);
-            if(cache_e->is_dirty){
-                cache_e->is_using = true;
-                disk_write(filesys_disk, cache_e->sector, &cache_e->data);
-                cache_e->is_using = false;
-                cache_e->is_dirty = false;
-            }
-        }
+    cache_lock_acquire();
+    cache_e = find_cache(sector_idx);
+    if(cache_e == NULL || !cache_e->is_dirty){
+        lock_release(&buffer_cache_lock);
+        return;
     }
+    cache_e->pin_cnt += 1;
+    lock_release(&buffer_cache_lock);
+
+    /* Pinned, so still SECTOR_IDX once we have it locked. */
+    lock_acquire(&cache_e->lock);
+    cache_lock_acquire();
+    dirty = cache_e->is_dirty;
+    meta = dirty && cache_e->type == CACHE_META;
+    cache_set_dirty(cache_e, false);
+    if(meta) meta_writes += 1;
+    lock_release(&buffer_cache_lock);
+    if(meta) free_map_flush();
+    if(dirty)
+        disk_write_multiple(filesys_disk, sector_idx, 1, cache_e->data,
+                            cache_disk_class(cache_e->type));
+    lock_release(&cache_e->lock);
+
+    cache_lock_acquire();
+    if(meta) cache_meta_write_done();
+    if(dirty) stats.type[cache_e->type].flushes += 1;
+    cache_unpin(cache_e);
     lock_release(&buffer_cache_lock);
-    return;
+}
+
+/* Writes back every dirty entry, e.g. to sync the file system. */
+void cache_write_behind_loop(void){
+    cache_write_back((size_t) -1, true);
 }
 
 void cache_write_behind(void* aux){
     while(1){
+        size_t dirty_pct = buffer_cache_dirty_cnt * 100 / cache_size;
+
+        if(dirty_pct > DIRTY_HIGH_PCT) flush_urgent = true;
+        else if(dirty_pct <= DIRTY_LOW_PCT) flush_urgent = false;
 
-        cache_write_behind_loop();
+        if(flush_urgent) cache_write_back((size_t) -1, true);
+        else cache_write_back(WRITE_BEHIND_BUDGET, false);
 
-        timer_sleep(TIMER_PERIOD);
+        timer_sleep(flush_urgent ? URGENT_PERIOD : TIMER_PERIOD);
     }
     return;
 }
+
+/* Queues SECTOR_IDX to be loaded into the cache by the read_ahead
+   thread.  Never blocks on disk I/O. */
+void cache_read_ahead(disk_sector_t sector_idx){
+    bool queued = false;
+
+    lock_acquire(&read_ahead_lock);
+    if(read_ahead_cnt < READ_AHEAD_QUEUE_SIZE){
+        read_ahead_queue[(read_ahead_head + read_ahead_cnt) % READ_AHEAD_QUEUE_SIZE] = sector_idx;
+        read_ahead_cnt += 1;
+        queued = true;
+    }
+    lock_release(&read_ahead_lock);
+    if(queued) sema_up(&read_ahead_sema);
+}
+
+/* Claims an entry for SECTOR_IDX, to be loaded by the read_ahead
+   thread's next batch, unless SECTOR_IDX is cached already.  Adds it
+   to the last request of the batch if it follows that request's
+   sectors, otherwise starts a new request.  Returns false if no
+   entry could be had.
+   The entries of a batch are held together while it is read, so only
+   unpinned entries are taken for them and read-ahead gives up rather
+   than wait for one: a thread waiting for a sector of the batch may
+   hold the entry we would be waiting for. */
+static bool
+cache_prefetch_claim(disk_sector_t sector_idx){
+    struct buffer_cache* cache_e;
+    struct disk_request* req;
+
+    cache_lock_acquire();
+    if(find_cache(sector_idx) != NULL){
+        lock_release(&buffer_cache_lock);
+        return true;
+    }
+    if(cache_current_size < cache_size) cache_e = allocate_new_cache(sector_idx);
+    else cache_e = evict_cache(sector_idx, false);
+    if(cache_e == NULL){
+        lock_release(&buffer_cache_lock);
+        return false;
+    }
+    stats.read_ahead += 1;
+    cache_e->type = CACHE_DATA;
+    cache_e->is_loading = true;
+    cache_policy_insert(cache_e);
+    lock_release(&buffer_cache_lock);
+
+    ra_entries[ra_cnt] = cache_e;
+    ra_data[ra_cnt] = cache_e->data;
+    req = ra_req_cnt > 0 ? &ra_requests[ra_req_cnt-1] : NULL;
+    if(req != NULL && req->sec_no + req->cnt == sector_idx && req->cnt < READ_AHEAD_RUN_MAX)
+        req->cnt += 1;
+    else{
+        req = &ra_requests[ra_req_cnt++];
+        req->disk = filesys_disk;
+        req->sec_no = sector_idx;
+        req->cnt = 1;
+        req->write = false;
+        req->class = DISK_FS_DATA;
+        req->buffer = NULL;
+        req->buffers = &ra_data[ra_cnt];
+        req->complete = disk_complete_sema;
+        req->aux = &ra_done;
+    }
+    ra_cnt += 1;
+    return true;
+}
+
+static void
+cache_read_ahead_daemon(void* aux UNUSED){
+    while(1){
+        size_t i;
+
+        /* Claim entries for everything queued, up to a batch, then
+           have all of the batch's requests queued on the disk at
+           once. */
+        ra_cnt = ra_req_cnt = 0;
+        sema_down(&read_ahead_sema);
+        do{
+            disk_sector_t sector_idx;
+
+            lock_acquire(&read_ahead_lock);
+            sector_idx = read_ahead_queue[read_ahead_head];
+            read_ahead_head = (read_ahead_head + 1) % READ_AHEAD_QUEUE_SIZE;
+            read_ahead_cnt -= 1;
+            lock_release(&read_ahead_lock);
+
+            if(!cache_prefetch_claim(sector_idx)) break;
+        } while(ra_cnt < READ_AHEAD_BATCH && sema_try_down(&read_ahead_sema));
+
+        for(i=0; i<ra_req_cnt; i++) disk_submit(&ra_requests[i]);
+        for(i=0; i<ra_req_cnt; i++) sema_down(&ra_done);
+        cache_lock_acquire();
+        for(i=0; i<ra_cnt; i++) ra_entries[i]->is_loading = false;
+        lock_release(&buffer_cache_lock);
+        for(i=0; i<ra_cnt; i++) cache_put(ra_entries[i], false);
+    }
+}
+
+/* Copies the buffer cache statistics into *OUT. */
+void cache_get_stats(struct cache_stats* out){
+    cache_lock_acquire();
+    *out = stats;
+    lock_release(&buffer_cache_lock);
+}
+
+/* Prints buffer cache statistics. */
+void cache_print_stats(void){
+    static const char* type_names[CACHE_TYPE_CNT] = {"data", "meta"};
+    struct cache_stats st;
+    int type;
+
+    cache_get_stats(&st);
+    printf("Buffer cache: %s policy, %zu of %zu entries used, "
+           "%lld read-ahead loads, %lld blank loads, %lld ghost hits, "
+           "%lld flush runs, %lld lock waits (%lld ticks)\n",
+           cache_policy == CACHE_POLICY_2Q ? "2q" : "clock",
+           cache_current_size, cache_size, st.read_ahead, st.blank_loads,
+           st.ghost_hits, st.flush_runs, st.lock_waits, st.lock_wait_ticks);
+    for(type=0; type<CACHE_TYPE_CNT; type++){
+        const struct cache_type_stats* ts = &st.type[type];
+        long long lookups = ts->hits + ts->load_waits + ts->misses;
+
+        printf("Buffer cache %s: %lld hits, %lld waits for loads, "
+               "%lld misses (%lld%% hit rate), "
+               "%lld evictions (%lld dirty), %lld flushed\n",
+               type_names[type], ts->hits, ts->load_waits, ts->misses,
+               lookups > 0 ? ts->hits * 100 / lookups : 0,
+               ts->evictions, ts->dirty_evictions, ts->flushes);
+    }
+}
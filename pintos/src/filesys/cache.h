@@ -1,30 +1,69 @@
+#ifndef FILESYS_CACHE_H
+#define FILESYS_CACHE_H
+
 
 #include <list.h>
+#include <hash.h>
 #include "threads/synch.h"
 #include <stdint.h>
 #include <stdbool.h>
+#include <cache-stats.h>
 #include "filesys/off_t.h"
 #include "devices/disk.h"
 
-#define MAX_CACHE_SIZE 64
+/* Number of cache entries unless -cache=N says otherwise. */
+#define CACHE_SIZE_DEFAULT 64
+
+/* Number of entries in the buffer cache, fixed at cache_init(). */
+extern size_t cache_size;
 
-struct list buffer_cache_list;
+/* Replacement policies, chosen with -cache-policy. */
+enum cache_policy
+  {
+    CACHE_POLICY_CLOCK,         /* Second chance over all entries. */
+    CACHE_POLICY_2Q             /* Scan-resistant 2Q. */
+  };
+extern enum cache_policy cache_policy;
+
+struct list buffer_cache_list;  /* Clock order, or 2Q's Am queue in LRU order. */
 struct lock buffer_cache_lock;
+struct condition buffer_cache_unpinned;  /* Signaled when an entry's pin_cnt drops to 0. */
 
 struct buffer_cache{
     disk_sector_t sector;
-    uint8_t data[DISK_SECTOR_SIZE];
+    uint8_t* data;                /* DISK_SECTOR_SIZE bytes in the data pool. */
+    enum cache_type type;         /* What the sector holds, as last
+                                     requested.  For statistics. */
     bool is_used;
-    bool is_dirty;
-    bool is_using;
-    struct list_elem elem;
+    bool is_hot;                  /* 2Q: on Am rather than A1in. */
+    bool is_dirty;                /* On the dirty list?  Protected by
+                                     buffer_cache_lock. */
+    bool is_loading;              /* Being read from disk?  Protected by
+                                     buffer_cache_lock. */
+    int pin_cnt;                  /* Threads using or waiting for this entry.
+                                     Protected by buffer_cache_lock. */
+    struct lock lock;             /* Held while data is loaded, written back
+                                     or copied. */
+    struct list_elem elem;        /* Element in buffer_cache_list or A1in. */
+    struct hash_elem hash_elem;   /* Element in buffer_cache_hash, keyed by sector. */
+    struct list_elem dirty_elem;  /* Element in the dirty list. */
 };
 
+bool cache_policy_parse(const char* name);
 void cache_init(void);
 struct buffer_cache* find_cache(disk_sector_t sector);
-void cache_read(disk_sector_t sector_idx, uint8_t* buffer, off_t bytes_read, int sector_ofs, int chunk_size);
-void cache_write(disk_sector_t sector_idx, uint8_t* buffer, off_t bytes_read, int sector_ofs, int chunk_size);
-struct buffer_cache* evict_cache(disk_sector_t sector_idx);
+struct buffer_cache* cache_get(disk_sector_t sector_idx, enum cache_type type);
+struct buffer_cache* cache_get_blank(disk_sector_t sector_idx, enum cache_type type);
+void cache_put(struct buffer_cache* cache_e, bool dirty);
+void cache_read(disk_sector_t sector_idx, uint8_t* buffer, off_t bytes_read, int sector_ofs, int chunk_size, enum cache_type type);
+void cache_write(disk_sector_t sector_idx, uint8_t* buffer, off_t bytes_read, int sector_ofs, int chunk_size, enum cache_type type);
+struct buffer_cache* evict_cache(disk_sector_t sector_idx, bool may_wait);
 struct buffer_cache* allocate_new_cache(disk_sector_t sector_idx);
+void cache_read_ahead(disk_sector_t sector_idx);
 void cache_write_behind(void* aux);
-void cache_write_behind_loop(void);
\ No newline at end of file
+void cache_write_behind_loop(void);
+void cache_write_sector(disk_sector_t sector_idx);
+void cache_get_stats(struct cache_stats* out);
+void cache_print_stats(void);
+
+#endif /* filesys/cache.h */
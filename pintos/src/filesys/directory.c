@@ -4,6 +4,7 @@
 #include <list.h>
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
+#include "filesys/cache.h"
 #include "threads/malloc.h"
 #include "threads/thread.h"
 
@@ -130,28 +131,61 @@ lookup (const struct dir *dir, const char *name,
         struct dir_entry *ep, off_t *ofsp) 
 {
   struct dir_entry e;
-  size_t ofs;
+  struct buffer_cache *block = NULL;
+  off_t block_ofs = 0;                  /* Index of BLOCK's sector in DIR. */
+  off_t length = inode_length (dir->inode);
+  bool found = false;
+  off_t ofs;
 
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
-  for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
-       ofs += sizeof e) {
-      // printf("-------------\nname : %s, ename : %s\n", name, e.name);
-      if (e.in_use && !strcmp (name, e.name)) 
+  /* Entries are compared in place in the buffer cache.  Only an
+     entry that straddles two sectors is copied out. */
+  for (ofs = 0; ofs + (off_t) sizeof e <= length; ofs += sizeof e)
+    {
+      const struct dir_entry *cur;
+      size_t sector_ofs = ofs % DISK_SECTOR_SIZE;
+
+      if (sector_ofs + sizeof e > DISK_SECTOR_SIZE)
+        {
+          if (block != NULL)
+            {
+              cache_put (block, false);
+              block = NULL;
+            }
+          if (inode_read_at (dir->inode, &e, sizeof e, ofs) != sizeof e)
+            break;
+          cur = &e;
+        }
+      else
+        {
+          /* A thread may hold only one cache entry at a time, so let
+             go of the previous sector before getting the next. */
+          if (block == NULL || block_ofs != ofs / DISK_SECTOR_SIZE)
+            {
+              if (block != NULL)
+                cache_put (block, false);
+              block_ofs = ofs / DISK_SECTOR_SIZE;
+              block = cache_get (inode_byte_to_sector (dir->inode, ofs),
+                                 CACHE_META);
+            }
+          cur = (const struct dir_entry *) (block->data + sector_ofs);
+        }
+
+      if (cur->in_use && !strcmp (name, cur->name)) 
         {
-          // printf("e in use: %d, strcmp : %d\n", e.in_use, strcmp(name, e.name));
           if (ep != NULL)
-            *ep = e;
+            *ep = *cur;
           if (ofsp != NULL)
             *ofsp = ofs;
-          return true;
+          found = true;
+          break;
         }
-      else{
-
-      }
     }
-  return false;
+  if (block != NULL)
+    cache_put (block, false);
+  return found;
 }
 
 /* Searches DIR for a file with the given NAME
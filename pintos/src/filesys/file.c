@@ -9,6 +9,7 @@ struct file
     struct inode *inode;        /* File's inode. */
     off_t pos;                  /* Current position. */
     bool deny_write;            /* Has file_deny_write() been called? */
+    struct read_ahead ra;       /* Sequential read-ahead window. */
   };
 
 /* Opens a file for the given INODE, of which it takes ownership,
@@ -68,6 +69,8 @@ file_get_inode (struct file *file)
 off_t
 file_read (struct file *file, void *buffer, off_t size) 
 {
+  if (!inode_is_dir (file->inode))
+    inode_read_ahead (file->inode, &file->ra, file->pos, size);
   off_t bytes_read = inode_read_at (file->inode, buffer, size, file->pos);
   file->pos += bytes_read;
   return bytes_read;
@@ -81,6 +84,8 @@ file_read (struct file *file, void *buffer, off_t size)
 off_t
 file_read_at (struct file *file, void *buffer, off_t size, off_t file_ofs) 
 {
+  if (!inode_is_dir (file->inode))
+    inode_read_ahead (file->inode, &file->ra, file_ofs, size);
   return inode_read_at (file->inode, buffer, size, file_ofs);
 }
 
@@ -102,7 +102,7 @@ parse_file(const char *name){
 void
 filesys_init (bool format) 
 {
-  filesys_disk = disk_get (0, 1);
+  filesys_disk = disk_get_role (DISK_ROLE_FS);
   if (filesys_disk == NULL)
     PANIC ("hd0:1 (hdb) not present, file system initialization failed");
 
@@ -124,8 +124,10 @@ void
 filesys_done (void) 
 {
   // printf("filesys done\n");
+  /* Releases are committed while the free map is still open. */
   cache_write_behind_loop();
   free_map_close ();
+  cache_write_behind_loop();
 }
 
 /* Creates a file named NAME with the given INITIAL_SIZE.
@@ -1,13 +1,55 @@
 #include "filesys/free-map.h"
 #include <bitmap.h>
 #include <debug.h>
+#include <round.h>
 #include "filesys/file.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
+#include "filesys/cache.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
 
 static struct file *free_map_file;   /* Free map file. */
 static struct bitmap *free_map;      /* Free map, one bit per disk sector. */
 
+/* Sectors of the free map file that differ from FREE_MAP, one bit
+   each.  Changes reach the disk only at free_map_flush(). */
+static struct bitmap *free_map_dirty;
+
+/* Disk sectors that hold the free map file, and a buffer for one of
+   them.  The free map is read and written straight to these, not
+   through the buffer cache, so that the cache can flush it before
+   writing back metadata without recursing into itself. */
+static disk_sector_t *map_sectors;
+static uint8_t map_buf[DISK_SECTOR_SIZE];
+
+/* Released sectors.  They stay allocated in FREE_MAP, so they are
+   not reused, until the metadata that referred to them has been
+   written back: free_map_release() adds them to PENDING,
+   free_map_begin_release() moves PENDING to RELEASING, and
+   free_map_end_release() frees those once the caller has written
+   back the metadata. */
+static struct bitmap *free_map_pending;
+static struct bitmap *free_map_releasing;
+static size_t pending_cnt, releasing_cnt;
+
+/* Allocation summary.  The free map is split into regions of
+   REGION_SECTORS sectors, and REGION_FREE counts the free sectors
+   in each, so that searches skip regions too full to hold a run.
+   Searches are next-fit: they start at CURSOR, just past the last
+   allocation, and wrap around. */
+#define REGION_SECTORS 512
+static size_t *region_free;
+static size_t region_cnt;
+static size_t free_cnt;              /* Free sectors in all. */
+static disk_sector_t cursor;
+
+/* Protects all of the above. */
+static struct lock free_map_lock;
+
+static void recount (void);
+static void flush_locked (void);
+
 /* Initializes the free map. */
 void
 free_map_init (void) 
@@ -15,8 +57,111 @@ free_map_init (void)
   free_map = bitmap_create (disk_size (filesys_disk));
   if (free_map == NULL)
     PANIC ("bitmap creation failed--disk is too large");
+  free_map_dirty = bitmap_create (DIV_ROUND_UP (bitmap_file_size (free_map),
+                                                DISK_SECTOR_SIZE));
+  free_map_pending = bitmap_create (bitmap_size (free_map));
+  free_map_releasing = bitmap_create (bitmap_size (free_map));
+  if (free_map_dirty == NULL || free_map_pending == NULL
+      || free_map_releasing == NULL)
+    PANIC ("bitmap creation failed--disk is too large");
+  region_cnt = DIV_ROUND_UP (bitmap_size (free_map), REGION_SECTORS);
+  region_free = malloc (region_cnt * sizeof *region_free);
+  if (region_free == NULL)
+    PANIC ("free map summary allocation failed");
+  lock_init (&free_map_lock);
   bitmap_mark (free_map, FREE_MAP_SECTOR);
   bitmap_mark (free_map, ROOT_DIR_SECTOR);
+  recount ();
+}
+
+/* Recomputes the allocation summary from the free map. */
+static void
+recount (void) 
+{
+  size_t r;
+
+  free_cnt = 0;
+  for (r = 0; r < region_cnt; r++)
+    {
+      size_t start = r * REGION_SECTORS;
+      size_t cnt = bitmap_size (free_map) - start;
+      if (cnt > REGION_SECTORS)
+        cnt = REGION_SECTORS;
+      region_free[r] = bitmap_count (free_map, start, cnt, false);
+      free_cnt += region_free[r];
+    }
+  cursor = 0;
+}
+
+/* Adds DELTA, per sector, to the summary's free counts for the CNT
+   sectors starting at SECTOR. */
+static void
+adjust_summary (disk_sector_t sector, size_t cnt, int delta) 
+{
+  while (cnt > 0)
+    {
+      size_t r = sector / REGION_SECTORS;
+      size_t n = (r + 1) * REGION_SECTORS - sector;
+      if (n > cnt)
+        n = cnt;
+      region_free[r] += delta * (int) n;
+      free_cnt += delta * (int) n;
+      sector += n;
+      cnt -= n;
+    }
+}
+
+/* Returns the first sector at or after START, and before END, that
+   begins a run of CNT free sectors, or BITMAP_ERROR if there is
+   none.  A run that begins K sectors before the end of a region
+   needs min(K, CNT) free sectors in it, so in a region with fewer
+   than CNT free sectors the search skips ahead to the last sectors
+   a run could still begin at, and on into the next region. */
+static size_t
+find_run (size_t start, size_t end, size_t cnt) 
+{
+  size_t size = bitmap_size (free_map);
+  size_t i = start;
+
+  if (end > size)
+    end = size;
+  while (i < end && i + cnt <= size)
+    {
+      size_t r = i / REGION_SECTORS;
+      size_t region_end = (r + 1) * REGION_SECTORS;
+      size_t j;
+
+      if (region_end > size)
+        region_end = size;
+      if (region_free[r] < cnt && region_end - i > region_free[r])
+        {
+          i = region_end - region_free[r];
+          continue;
+        }
+      if (bitmap_test (free_map, i))
+        {
+          i++;
+          continue;
+        }
+      for (j = i + 1; j < i + cnt && !bitmap_test (free_map, j); j++)
+        continue;
+      if (j == i + cnt)
+        return i;
+      i = j + 1;
+    }
+  return BITMAP_ERROR;
+}
+
+/* Marks the free map file sectors that hold the bits of the CNT
+   sectors starting at SECTOR as changed.  Needs free_map_lock. */
+static void
+mark_dirty (disk_sector_t sector, size_t cnt) 
+{
+  size_t bits_per_sector = DISK_SECTOR_SIZE * 8;
+  size_t first = sector / bits_per_sector;
+  size_t last = (sector + cnt - 1) / bits_per_sector;
+
+  bitmap_set_multiple (free_map_dirty, first, last - first + 1, true);
 }
 
 /* Allocates CNT consecutive sectors from the free map and stores
@@ -26,44 +171,187 @@ free_map_init (void)
 bool
 free_map_allocate (size_t cnt, disk_sector_t *sectorp) 
 {
-  disk_sector_t sector = bitmap_scan_and_flip (free_map, 0, cnt, false);
-  if (sector != BITMAP_ERROR
-      && free_map_file != NULL
-      && !bitmap_write (free_map, free_map_file))
+  size_t sector = BITMAP_ERROR;
+
+  lock_acquire (&free_map_lock);
+  if (cnt <= free_cnt)
     {
-      bitmap_set_multiple (free_map, sector, cnt, false); 
-      sector = BITMAP_ERROR;
+      sector = find_run (cursor, bitmap_size (free_map), cnt);
+      if (sector == BITMAP_ERROR && cursor > 0)
+        sector = find_run (0, cursor, cnt);
     }
   if (sector != BITMAP_ERROR)
-    *sectorp = sector;
+    {
+      bitmap_set_multiple (free_map, sector, cnt, true);
+      adjust_summary (sector, cnt, -1);
+      mark_dirty (sector, cnt);
+      cursor = sector + cnt < bitmap_size (free_map) ? sector + cnt : 0;
+      *sectorp = sector;
+    }
+  lock_release (&free_map_lock);
   return sector != BITMAP_ERROR;
 }
 
-/* Makes CNT sectors starting at SECTOR available for use. */
+/* Makes CNT sectors starting at SECTOR available for use, once the
+   metadata that referred to them is on disk; see
+   free_map_begin_release().  The caller must already have dropped
+   its references to them, in the buffer cache. */
 void
 free_map_release (disk_sector_t sector, size_t cnt)
 {
+  lock_acquire (&free_map_lock);
   ASSERT (bitmap_all (free_map, sector, cnt));
-  bitmap_set_multiple (free_map, sector, cnt, false);
-  bitmap_write (free_map, free_map_file);
+  ASSERT (bitmap_none (free_map_pending, sector, cnt));
+  ASSERT (bitmap_none (free_map_releasing, sector, cnt));
+  bitmap_set_multiple (free_map_pending, sector, cnt, true);
+  pending_cnt += cnt;
+  lock_release (&free_map_lock);
 }
 
-/* Opens the free map file and reads it from disk. */
+/* Starts freeing the sectors released so far.  Returns false if
+   there are none.  Otherwise the caller must write back all the
+   metadata that was dirty when this was called, then call
+   free_map_end_release().  Calls must not overlap. */
+bool
+free_map_begin_release (void) 
+{
+  struct bitmap *swap;
+
+  lock_acquire (&free_map_lock);
+  ASSERT (releasing_cnt == 0);
+  swap = free_map_releasing;
+  free_map_releasing = free_map_pending;
+  free_map_pending = swap;
+  releasing_cnt = pending_cnt;
+  pending_cnt = 0;
+  lock_release (&free_map_lock);
+  return releasing_cnt > 0;
+}
+
+/* Frees the sectors taken by free_map_begin_release() and writes
+   the free map to disk. */
 void
-free_map_open (void) 
+free_map_end_release (void) 
+{
+  size_t size = bitmap_size (free_map_releasing);
+  size_t sector = 0;
+
+  lock_acquire (&free_map_lock);
+  while (releasing_cnt > 0)
+    {
+      size_t cnt = 1;
+
+      sector = bitmap_scan (free_map_releasing, sector, 1, true);
+      ASSERT (sector != BITMAP_ERROR);
+      while (sector + cnt < size
+             && bitmap_test (free_map_releasing, sector + cnt))
+        cnt++;
+      bitmap_set_multiple (free_map_releasing, sector, cnt, false);
+      bitmap_set_multiple (free_map, sector, cnt, false);
+      adjust_summary (sector, cnt, 1);
+      mark_dirty (sector, cnt);
+      releasing_cnt -= cnt;
+      sector += cnt;
+    }
+  flush_locked ();
+  lock_release (&free_map_lock);
+}
+
+/* Reports the file system's size and free space in *ST.  Cheap:
+   reads the allocation summary, not the free map.  Released
+   sectors count as free even before they can be reused. */
+void
+free_map_get_stats (struct fs_stats *st) 
 {
+  lock_acquire (&free_map_lock);
+  st->sector_size = DISK_SECTOR_SIZE;
+  st->total_sectors = bitmap_size (free_map);
+  st->free_sectors = free_cnt + pending_cnt + releasing_cnt;
+  lock_release (&free_map_lock);
+}
+
+/* Writes the changed sectors of the free map straight to disk.
+   The buffer cache calls this before it writes back any inode,
+   extent block or directory block, so that the bits allocating the
+   sectors such a block refers to are on disk first.  Released
+   sectors are only freed here after the blocks that referred to
+   them are; see free_map_begin_release().  So after a crash the
+   free map on disk may leak sectors, but never marks a sector free
+   that metadata on disk still uses. */
+void
+free_map_flush (void) 
+{
+  lock_acquire (&free_map_lock);
+  flush_locked ();
+  lock_release (&free_map_lock);
+}
+
+/* Does the work of free_map_flush(), with free_map_lock held. */
+static void
+flush_locked (void) 
+{
+  size_t i;
+
+  if (map_sectors == NULL)
+    return;
+  for (i = 0; i < bitmap_size (free_map_dirty); i++)
+    if (bitmap_test (free_map_dirty, i))
+      {
+        bitmap_get_image (free_map, i * DISK_SECTOR_SIZE, map_buf,
+                          DISK_SECTOR_SIZE);
+        disk_write_multiple (filesys_disk, map_sectors[i], 1, map_buf,
+                             DISK_FS_META);
+        bitmap_reset (free_map_dirty, i);
+      }
+}
+
+/* Opens the free map file and looks up the sectors that hold it. */
+static void
+open_file (void) 
+{
+  struct inode *inode;
+  size_t i;
+
   free_map_file = file_open (inode_open (FREE_MAP_SECTOR));
   if (free_map_file == NULL)
     PANIC ("can't open free map");
-  if (!bitmap_read (free_map, free_map_file))
-    PANIC ("can't read free map");
+  inode = file_get_inode (free_map_file);
+  map_sectors = malloc (bitmap_size (free_map_dirty) * sizeof *map_sectors);
+  if (map_sectors == NULL)
+    PANIC ("can't open free map");
+  for (i = 0; i < bitmap_size (free_map_dirty); i++)
+    map_sectors[i] = inode_byte_to_sector (inode, i * DISK_SECTOR_SIZE);
+}
+
+/* Opens the free map file and reads it from disk. */
+void
+free_map_open (void) 
+{
+  size_t i;
+
+  open_file ();
+  for (i = 0; i < bitmap_size (free_map_dirty); i++)
+    {
+      disk_read_multiple (filesys_disk, map_sectors[i], 1, map_buf,
+                          DISK_FS_META);
+      bitmap_set_image (free_map, i * DISK_SECTOR_SIZE, map_buf,
+                        DISK_SECTOR_SIZE);
+    }
+  bitmap_set_all (free_map_dirty, false);
+  recount ();
 }
 
 /* Writes the free map to disk and closes the free map file. */
 void
 free_map_close (void) 
 {
+  lock_acquire (&free_map_lock);
+  flush_locked ();
+  free (map_sectors);
+  map_sectors = NULL;
+  lock_release (&free_map_lock);
   file_close (free_map_file);
+  free_map_file = NULL;
 }
 
 /* Creates a new free map file on disk and writes the free map to
@@ -71,14 +359,22 @@ free_map_close (void)
 void
 free_map_create (void) 
 {
+  size_t i;
+
   /* Create inode. */
   if (!inode_create (FREE_MAP_SECTOR, bitmap_file_size (free_map), false))
     PANIC ("free map creation failed");
+  open_file ();
 
-  /* Write bitmap to file. */
-  free_map_file = file_open (inode_open (FREE_MAP_SECTOR));
-  if (free_map_file == NULL)
-    PANIC ("can't open free map");
-  if (!bitmap_write (free_map, free_map_file))
-    PANIC ("can't write free map");
+  /* inode_create() zeroed the file in the buffer cache.  Write
+     those copies back now, so they cannot overwrite the map
+     later. */
+  for (i = 0; i < bitmap_size (free_map_dirty); i++)
+    cache_write_sector (map_sectors[i]);
+
+  /* Write bitmap to disk. */
+  lock_acquire (&free_map_lock);
+  bitmap_set_all (free_map_dirty, true);
+  flush_locked ();
+  lock_release (&free_map_lock);
 }
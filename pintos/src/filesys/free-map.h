@@ -3,6 +3,7 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <fs-stats.h>
 #include "devices/disk.h"
 
 void free_map_init (void);
@@ -13,5 +14,9 @@ void free_map_close (void);
 
 bool free_map_allocate (size_t, disk_sector_t *);
 void free_map_release (disk_sector_t, size_t);
+bool free_map_begin_release (void);
+void free_map_end_release (void);
+void free_map_flush (void);
+void free_map_get_stats (struct fs_stats *);
 
 #endif /* filesys/free-map.h */
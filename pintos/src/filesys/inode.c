@@ -12,14 +12,51 @@
 /* Identifies an inode. */
 #define INODE_MAGIC 0x494e4f44
 
-#define NUM_PTRS 15
-#define NUM_PTRS_DIR 4
-#define NUM_PTRS_INDIR 10
-#define NUM_PTRS_DOUBLE 1
-
 #define FILE_SIZE_MAX 1<<23
 
-#define PTR_PER_BLOCK 128 // 512/4
+/* A run of LENGTH consecutive disk sectors starting at START that
+   holds LENGTH consecutive sectors of a file, or a hole of LENGTH
+   sectors that read as zeros and have no disk sectors yet, if
+   START is HOLE_SECTOR. */
+struct extent
+  {
+    disk_sector_t start;                /* First disk sector. */
+    uint32_t length;                    /* Number of sectors. */
+  };
+
+/* Start of a hole's extent.  Sector 0 holds the free map inode,
+   so it is never file data. */
+#define HOLE_SECTOR FREE_MAP_SECTOR
+
+/* Extents held in the on-disk inode itself.  The rest spill into a
+   chain of extent blocks. */
+#define EXTENTS_INLINE 60
+
+/* Extents per extent block. */
+#define EXTENTS_PER_BLOCK 63
+
+/* An extent block.
+   Must be exactly DISK_SECTOR_SIZE bytes long. */
+struct extent_block
+  {
+    disk_sector_t next;                 /* Next extent block, or 0. */
+    uint32_t unused;                    /* Not used. */
+    struct extent extents[EXTENTS_PER_BLOCK];
+  };
+
+/* Longest run of sectors inode_grow() asks the free map for at
+   once. */
+#define GROW_RUN_MAX 256
+
+/* Most sectors of a hole filled at once by a write.  They are
+   zeroed in the buffer cache before the write copies in its data,
+   so this stays well below the cache size.  Fills that follow one
+   another are still laid out contiguously and join one extent. */
+#define FILL_RUN_MAX 16
+
+/* Read-ahead window bounds, in sectors. */
+#define READ_AHEAD_MIN 4
+#define READ_AHEAD_MAX 16
 
 /* On-disk inode.
    Must be exactly DISK_SECTOR_SIZE bytes long. */
@@ -29,15 +66,14 @@ struct inode_disk
     unsigned magic;                     /* Magic number. */
 
     unsigned is_allocated;
-
-    disk_sector_t ptrs[NUM_PTRS];
-    unsigned ptr_idx;
-    unsigned indir_idx;
-    unsigned double_indir_idx;
     unsigned is_dir;
     disk_sector_t parent;
 
-    uint32_t unused[105];               /* Not used. */
+    uint32_t extent_cnt;                /* Number of extents in all. */
+    disk_sector_t spill;                /* First extent block, or 0. */
+    struct extent extents[EXTENTS_INLINE];  /* The first extents, in
+                                               file order. */
+    uint32_t unused[1];                 /* Not used. */
   };
 
 /* Returns the number of sectors to allocate for an inode SIZE
@@ -61,13 +97,30 @@ struct inode
     off_t length_shown;
 
     unsigned is_allocated;
-    disk_sector_t ptrs[NUM_PTRS];
-    unsigned ptr_idx;
-    unsigned indir_idx;
-    unsigned double_indir_idx;
     unsigned is_dir;
     disk_sector_t parent;
     struct lock lock;
+
+    /* Block map, read from disk at inode_open() and written back at
+       inode_close().  Only a thread that may grow INODE changes it,
+       but lookups come from any reader, so every change, and every
+       lookup, holds MAP_LOCK. */
+    struct lock map_lock;               /* Guards the fields below. */
+    struct inode_extent *extents;       /* Extents in file order. */
+    size_t extent_cnt;                  /* Number of extents in use. */
+    size_t extent_max;                  /* Room in EXTENTS. */
+    size_t extent_hint;                 /* Extent of the last lookup. */
+    disk_sector_t *spill;               /* Extent blocks, in chain order. */
+    size_t spill_cnt;                   /* Number of extent blocks. */
+  };
+
+/* An extent of an in-memory inode, with the file sector it starts
+   at, so that lookups can binary search. */
+struct inode_extent
+  {
+    disk_sector_t start;                /* First disk sector. */
+    size_t length;                      /* Number of sectors. */
+    size_t ofs;                         /* First file sector. */
   };
 
 void
@@ -80,52 +133,105 @@ inode_lock_release(struct inode* inode){
   lock_release(&inode->lock);
 }
 
+/* Returns the kind of sector INODE's data blocks are, for the
+   buffer cache.  Directory contents and the free map count as
+   metadata. */
+static enum cache_type
+inode_cache_type (const struct inode *inode)
+{
+  if (inode->is_dir == 1 || inode->sector == FREE_MAP_SECTOR)
+    return CACHE_META;
+  return CACHE_DATA;
+}
+
+/* Returns the number of file sectors INODE's extents cover. */
+static size_t
+inode_mapped_sectors (const struct inode *inode)
+{
+  const struct inode_extent *last;
+
+  if (inode->extent_cnt == 0)
+    return 0;
+  last = &inode->extents[inode->extent_cnt - 1];
+  return last->ofs + last->length;
+}
+
+/* Returns the index of the extent of INODE that holds file sector
+   OFS, which must be mapped.  Tries the extent of the previous
+   lookup and the one after it first, which sequential access
+   hits, then binary searches.  INODE's MAP_LOCK must be held. */
+static size_t
+find_extent (const struct inode *inode, size_t ofs)
+{
+  const struct inode_extent *e = inode->extents;
+  size_t lo = 0, hi = inode->extent_cnt, hint = inode->extent_hint;
+
+  ASSERT (ofs < inode_mapped_sectors (inode));
+
+  if (hint < hi && ofs >= e[hint].ofs)
+    {
+      if (ofs - e[hint].ofs < e[hint].length)
+        return hint;
+      if (hint + 1 < hi && ofs - e[hint + 1].ofs < e[hint + 1].length)
+        return hint + 1;
+    }
+  while (hi - lo > 1)
+    {
+      size_t mid = (lo + hi) / 2;
+      if (ofs < e[mid].ofs)
+        hi = mid;
+      else
+        lo = mid;
+    }
+  return lo;
+}
+
 /* Returns the disk sector that contains byte offset POS within
-   INODE.
+   INODE, or HOLE_SECTOR if POS is in a hole.
    Returns -1 if INODE does not contain data for a byte at offset
    POS. */
 static disk_sector_t
-byte_to_sector (const struct inode *inode, off_t pos) 
+byte_to_sector (struct inode *inode, off_t pos) 
 {
-  // printf("pos : %d, sector: %d\n", pos, inode->ptrs[pos/DISK_SECTOR_SIZE]);
-  int new_pos;
-  unsigned idx_ptr;
+  size_t ofs, idx;
+  disk_sector_t sector;
+
   ASSERT (inode != NULL);
-  if(pos < inode_length(inode)){
-    if(pos < DISK_SECTOR_SIZE*NUM_PTRS_DIR){
+  if (pos >= inode_length (inode))
+    return -1;
 
-      return inode->ptrs[pos/DISK_SECTOR_SIZE];
-    }
-    
-    disk_sector_t inner_ptr[PTR_PER_BLOCK];
-    new_pos = pos - DISK_SECTOR_SIZE*NUM_PTRS_DIR;
-    if (new_pos < DISK_SECTOR_SIZE*(NUM_PTRS_INDIR * PTR_PER_BLOCK)){
-      idx_ptr = NUM_PTRS_DIR + (new_pos / DISK_SECTOR_SIZE / PTR_PER_BLOCK);
-      new_pos = (new_pos) % (DISK_SECTOR_SIZE*PTR_PER_BLOCK);
-      disk_read(filesys_disk, inode->ptrs[idx_ptr], &inner_ptr);
-      return inner_ptr[new_pos/DISK_SECTOR_SIZE];
-    }
-    else{
-      /* here, big files - double indirect blocks */
-      disk_sector_t double_inner_ptr[PTR_PER_BLOCK];
-      new_pos = new_pos - DISK_SECTOR_SIZE*NUM_PTRS_INDIR*PTR_PER_BLOCK;
-      idx_ptr = NUM_PTRS_DIR + NUM_PTRS_INDIR + (new_pos / (DISK_SECTOR_SIZE * PTR_PER_BLOCK * PTR_PER_BLOCK));
-      ASSERT(idx_ptr == 14);
-
-      disk_read(filesys_disk, inode->ptrs[idx_ptr], &inner_ptr);
-      new_pos = new_pos - (idx_ptr-NUM_PTRS_DIR-NUM_PTRS_INDIR) * DISK_SECTOR_SIZE * PTR_PER_BLOCK * PTR_PER_BLOCK;
-
-      int double_idx_ptr = new_pos / DISK_SECTOR_SIZE / PTR_PER_BLOCK;
-      new_pos = new_pos % (DISK_SECTOR_SIZE*PTR_PER_BLOCK);
-      disk_read(filesys_disk, inner_ptr[double_idx_ptr], &double_inner_ptr);
-      return double_inner_ptr[new_pos/DISK_SECTOR_SIZE];
-    }
-  }
+  ofs = pos / DISK_SECTOR_SIZE;
+  lock_acquire (&inode->map_lock);
+  idx = find_extent (inode, ofs);
+  inode->extent_hint = idx;
+  sector = inode->extents[idx].start;
+  if (sector != HOLE_SECTOR)
+    sector += ofs - inode->extents[idx].ofs;
+  lock_release (&inode->map_lock);
+  return sector;
+}
 
-  else{
+/* Returns the disk sector that holds byte offset POS in INODE,
+   for callers that access INODE's blocks through the buffer cache
+   directly.  Only directories and the free map do, and they never
+   have holes. */
+disk_sector_t
+inode_byte_to_sector (struct inode *inode, off_t pos)
+{
+  disk_sector_t sector = byte_to_sector (inode, pos);
 
-    return -1;
-  }
+  ASSERT (sector != HOLE_SECTOR);
+  return sector;
+}
+
+/* Returns true if INODE's growth may leave holes.  Directories are
+   read through inode_byte_to_sector() and the free map would have
+   to allocate from itself to fill one, so both are allocated in
+   full. */
+static bool
+inode_may_have_holes (const struct inode *inode)
+{
+  return inode->is_dir == 0 && inode->sector != FREE_MAP_SECTOR;
 }
 
 /* List of open inodes, so that opening a single inode twice
@@ -139,101 +245,419 @@ inode_init (void)
   list_init (&open_inodes);
 }
 
-bool inode_grow(struct inode* inode, off_t length){
-  // printf("inode grow start\n");
+/* Zeroes data sector SECTOR of INODE through the buffer cache, so
+   that no stale cached copy of a previous use of SECTOR survives. */
+static void
+inode_zero_sector (const struct inode *inode, disk_sector_t sector)
+{
+  struct buffer_cache *block = cache_get_blank (sector, inode_cache_type (inode));
+  memset (block->data, 0, DISK_SECTOR_SIZE);
+  cache_put (block, true);
+}
 
-  disk_sector_t inner_ptr[PTR_PER_BLOCK];
-  disk_sector_t double_inner_ptr[PTR_PER_BLOCK];
-  static char data_default[DISK_SECTOR_SIZE];
+/* Returns true if the CNT sectors at START can join the end of
+   extent E: both are holes, or both are data and adjacent on
+   disk. */
+static bool
+extent_joins (const struct inode_extent *e, disk_sector_t start)
+{
+  if (e->start == HOLE_SECTOR || start == HOLE_SECTOR)
+    return e->start == start;
+  return e->start + e->length == start;
+}
+
+/* Makes sure INODE's extent array has room for EXTRA more
+   extents.  Returns false if out of memory.
+   Lookups may be reading the old array, so it is copied rather
+   than realloc()'d and freed only after the new one has replaced
+   it under MAP_LOCK. */
+static bool
+inode_extent_room (struct inode *inode, size_t extra)
+{
+  size_t max = inode->extent_max > 0 ? inode->extent_max : 4;
+  struct inode_extent *extents, *old;
+
+  while (max < inode->extent_cnt + extra)
+    max *= 2;
+  if (max == inode->extent_max)
+    return true;
+  extents = malloc (max * sizeof *extents);
+  if (extents == NULL)
+    return false;
+  if (inode->extent_cnt > 0)
+    memcpy (extents, inode->extents, inode->extent_cnt * sizeof *extents);
+
+  lock_acquire (&inode->map_lock);
+  old = inode->extents;
+  inode->extents = extents;
+  inode->extent_max = max;
+  lock_release (&inode->map_lock);
+  free (old);
+  return true;
+}
 
-  size_t sectors = bytes_to_sectors(length) - bytes_to_sectors(inode->length);
+/* Maps the CNT disk sectors from START, or a hole of CNT sectors
+   if START is HOLE_SECTOR, to the file sectors just past INODE's
+   last extent, extending that extent if they join it.  Returns
+   false if out of memory. */
+static bool
+inode_append_extent (struct inode *inode, disk_sector_t start, size_t cnt)
+{
+  bool joins = (inode->extent_cnt > 0
+                && extent_joins (&inode->extents[inode->extent_cnt - 1],
+                                 start));
 
-  unsigned idx = inode->ptr_idx;
-  while(idx<NUM_PTRS){
-    if(!(sectors > 0)) break;
+  if (!joins && !inode_extent_room (inode, 1))
+    return false;
 
-    if(idx<NUM_PTRS_DIR){
-      if(!free_map_allocate(1, &inode->ptrs[idx])) return -1;
-      disk_write(filesys_disk, inode->ptrs[idx], data_default);
-      sectors -= 1;
-      idx += 1;
+  lock_acquire (&inode->map_lock);
+  if (joins)
+    inode->extents[inode->extent_cnt - 1].length += cnt;
+  else
+    {
+      struct inode_extent *e = &inode->extents[inode->extent_cnt];
+      e->start = start;
+      e->length = cnt;
+      e->ofs = inode_mapped_sectors (inode);
+      inode->extent_cnt++;
     }
+  lock_release (&inode->map_lock);
+  return true;
+}
+
+/* Appends the CNT on-disk EXTENTS to INODE's.  Returns false if
+   out of memory. */
+static bool
+inode_load_extents (struct inode *inode, const struct extent *extents,
+                    size_t cnt)
+{
+  size_t i;
 
-    /* indirect level 1 */
-    else if(idx<NUM_PTRS_DIR + NUM_PTRS_INDIR){
-      if(inode->indir_idx==0){
-        if(!free_map_allocate(1, &inode->ptrs[idx])) return -1; // check whether block is allocated
-      }
-      else{
-        disk_read(filesys_disk, inode->ptrs[idx], &inner_ptr);
-      }
-      unsigned indir_idx = inode->indir_idx;
-      while(indir_idx<PTR_PER_BLOCK){
-        if(!(sectors > 0)) break;
-        if(!free_map_allocate(1, &inner_ptr[indir_idx])) return -1;
-        disk_write(filesys_disk, inner_ptr[indir_idx], data_default);
-
-        indir_idx += 1;
-        sectors -= 1;
-      }
-      inode->indir_idx = indir_idx;
-      disk_write(filesys_disk, inode->ptrs[idx], &inner_ptr);
-
-      if(inode->indir_idx == PTR_PER_BLOCK){
-        inode->indir_idx = 0;
-        idx += 1;
-      }
+  for (i = 0; i < cnt; i++)
+    if (!inode_append_extent (inode, extents[i].start, extents[i].length))
+      return false;
+  return true;
+}
+
+/* Appends INODE's last LEFT extents, read from the chain of
+   extent blocks that starts at SPILL.  Returns false if out of
+   memory. */
+static bool
+inode_load_spill (struct inode *inode, disk_sector_t spill, size_t left)
+{
+  size_t n;
+
+  while (left > 0)
+    {
+      struct buffer_cache *block;
+      const struct extent_block *eb;
+      disk_sector_t *spill_ = realloc (inode->spill, (inode->spill_cnt + 1)
+                                                     * sizeof *inode->spill);
+      if (spill_ == NULL)
+        return false;
+      inode->spill = spill_;
+      inode->spill[inode->spill_cnt++] = spill;
+
+      block = cache_get (spill, CACHE_META);
+      eb = (const struct extent_block *) block->data;
+      n = left < EXTENTS_PER_BLOCK ? left : EXTENTS_PER_BLOCK;
+      if (!inode_load_extents (inode, eb->extents, n))
+        {
+          cache_put (block, false);
+          return false;
+        }
+      spill = eb->next;
+      cache_put (block, false);
+      left -= n;
     }
+  return true;
+}
 
-    /* indirect level 2 */
-    else if(idx<NUM_PTRS_DIR + NUM_PTRS_INDIR + NUM_PTRS_DOUBLE){
-      if(inode->indir_idx==0 && inode->double_indir_idx==0){ //initial condition
-        if(!free_map_allocate(1, &inode->ptrs[idx])) return -1;
-      }
-      else{
-        disk_read(filesys_disk, inode->ptrs[idx], &inner_ptr);
-      }
-      unsigned indir_idx = inode->indir_idx;
-      while(indir_idx<PTR_PER_BLOCK){
-        if(!(sectors > 0)) break;
-        if(inode->double_indir_idx==0){
-          if(!free_map_allocate(1, &inner_ptr[inode->indir_idx])) return -1;
+/* Returns the number of extent blocks needed for EXTENT_CNT
+   extents. */
+static size_t
+spill_needed (size_t extent_cnt)
+{
+  if (extent_cnt <= EXTENTS_INLINE)
+    return 0;
+  return DIV_ROUND_UP (extent_cnt - EXTENTS_INLINE, EXTENTS_PER_BLOCK);
+}
+
+/* Allocates the extent blocks INODE's extents, and EXTRA more,
+   need beyond those it has, so that writing them back at close
+   cannot run out of room.  Returns false if out of disk space or
+   memory. */
+static bool
+inode_reserve_spill (struct inode *inode, size_t extra)
+{
+  size_t need = spill_needed (inode->extent_cnt + extra);
+
+  if (need > inode->spill_cnt)
+    {
+      disk_sector_t *spill = realloc (inode->spill, need * sizeof *spill);
+      if (spill == NULL)
+        return false;
+      inode->spill = spill;
+      while (inode->spill_cnt < need)
+        {
+          if (!free_map_allocate (1, &inode->spill[inode->spill_cnt]))
+            return false;
+          inode->spill_cnt++;
         }
-        else{
-          disk_read(filesys_disk, inner_ptr[inode->indir_idx], &double_inner_ptr);
+    }
+  return true;
+}
+
+/* Writes INODE's extents past the EXTENTS_INLINE that fit in the
+   on-disk inode to its extent blocks. */
+static void
+inode_store_spill (struct inode *inode)
+{
+  size_t need = spill_needed (inode->extent_cnt), b, i;
+
+  ASSERT (need <= inode->spill_cnt);
+  for (b = 0; b < need; b++)
+    {
+      struct buffer_cache *block = cache_get_blank (inode->spill[b], CACHE_META);
+      struct extent_block *eb = (struct extent_block *) block->data;
+      size_t first = EXTENTS_INLINE + b * EXTENTS_PER_BLOCK;
+
+      memset (eb, 0, sizeof *eb);
+      eb->next = b + 1 < need ? inode->spill[b + 1] : 0;
+      for (i = 0; i < EXTENTS_PER_BLOCK && first + i < inode->extent_cnt; i++)
+        {
+          eb->extents[i].start = inode->extents[first + i].start;
+          eb->extents[i].length = inode->extents[first + i].length;
         }
-        unsigned double_indir_idx = inode->double_indir_idx;
-        while(double_indir_idx<PTR_PER_BLOCK){
-          if(!(sectors > 0)) break;
-          if(!free_map_allocate(1, &double_inner_ptr[double_indir_idx])) return -1;
-          disk_write(filesys_disk, double_inner_ptr[double_indir_idx], data_default);
-
-          double_indir_idx += 1;
-          sectors -= 1;
+      cache_put (block, true);
+    }
+}
+
+/* Writes INODE to its sector, extent blocks first.  If BLANK, the
+   sector is a new inode, so its old contents are not read. */
+static void
+inode_store (struct inode *inode, off_t length, bool blank)
+{
+  struct buffer_cache *block;
+  struct inode_disk *disk_inode;
+  size_t need = spill_needed (inode->extent_cnt), i;
+
+  inode_store_spill (inode);
+
+  block = blank ? cache_get_blank (inode->sector, CACHE_META)
+                : cache_get (inode->sector, CACHE_META);
+  disk_inode = (struct inode_disk *) block->data;
+  memset (disk_inode, 0, sizeof *disk_inode);
+  disk_inode->length = length;
+  disk_inode->magic = INODE_MAGIC;
+  disk_inode->is_allocated = inode->is_allocated;
+  disk_inode->is_dir = inode->is_dir;
+  disk_inode->parent = inode->parent;
+  disk_inode->extent_cnt = inode->extent_cnt;
+  disk_inode->spill = need > 0 ? inode->spill[0] : 0;
+  for (i = 0; i < EXTENTS_INLINE && i < inode->extent_cnt; i++)
+    {
+      disk_inode->extents[i].start = inode->extents[i].start;
+      disk_inode->extents[i].length = inode->extents[i].length;
+    }
+  cache_put (block, true);
+
+  /* Extent blocks reserved for more extents than INODE ended up
+     with are on no chain now, so they go back to the free map.
+     Only now: see free_map_release(). */
+  while (inode->spill_cnt > need)
+    free_map_release (inode->spill[--inode->spill_cnt], 1);
+}
+
+/* Returns INODE's data sectors and extent blocks to the free map. */
+static void
+inode_release_blocks (struct inode *inode)
+{
+  size_t i;
+
+  for (i = 0; i < inode->extent_cnt; i++)
+    if (inode->extents[i].start != HOLE_SECTOR)
+      free_map_release (inode->extents[i].start, inode->extents[i].length);
+  for (i = 0; i < inode->spill_cnt; i++)
+    free_map_release (inode->spill[i], 1);
+}
+
+/* Frees INODE's in-memory block map. */
+static void
+inode_free_extents (struct inode *inode)
+{
+  free (inode->extents);
+  free (inode->spill);
+}
+
+/* Extends INODE until it has room for LENGTH bytes.  Counts from
+   the sectors already mapped rather than from INODE's length, so a
+   grow that failed part way is resumed, not redone.
+
+   Regular files grow by a hole, which costs no disk space or I/O
+   until it is written.  Other inodes get zeroed sectors at once:
+   asks the free map for the whole extension as one run, up to
+   GROW_RUN_MAX sectors, and for runs half as long each time that
+   fails, so that their data lands in long extents.
+   Returns false if out of disk space or memory. */
+bool inode_grow(struct inode* inode, off_t length){
+  size_t mapped = inode_mapped_sectors (inode);
+  size_t want = bytes_to_sectors (length);
+  size_t run = GROW_RUN_MAX;
+
+  if (mapped < want && inode_may_have_holes (inode))
+    {
+      if (!inode_append_extent (inode, HOLE_SECTOR, want - mapped)
+          || !inode_reserve_spill (inode, 0))
+        return false;
+      mapped = want;
+    }
+  while (mapped < want)
+    {
+      disk_sector_t sector;
+      size_t i;
+
+      if (run > want - mapped)
+        run = want - mapped;
+      while (!free_map_allocate (run, &sector))
+        {
+          if (run == 1)
+            return false;
+          run /= 2;
         }
-        inode->double_indir_idx = double_indir_idx;
-        disk_write(filesys_disk, inner_ptr[indir_idx], &double_inner_ptr);
 
-        if(inode->double_indir_idx == PTR_PER_BLOCK){
-          inode->double_indir_idx = 0;
-          indir_idx += 1;
+      /* Zeroed before they are mapped, so that a grow that fails
+         later on never leaves stale data readable. */
+      for (i = 0; i < run; i++)
+        inode_zero_sector (inode, sector + i);
+      if (!inode_append_extent (inode, sector, run))
+        {
+          free_map_release (sector, run);
+          return false;
         }
-        // else ASSERT(0);
-      }
-      inode->indir_idx = indir_idx;
-      disk_write(filesys_disk, inode->ptrs[idx], &inner_ptr);
+      if (!inode_reserve_spill (inode, 0))
+        return false;
+      mapped += run;
+    }
+  inode->is_allocated = 1;
+  return true;
+}
 
-      if(inode->indir_idx == PTR_PER_BLOCK){
-        inode->indir_idx = 0;
-        idx += 1;
-      }
+/* Gives disk sectors to file sectors OFS...OFS + CNT - 1 of INODE,
+   which must all lie in the hole at extent IDX, splitting the hole
+   around them.  Allocates one run if it can, or fewer sectors if
+   not, down to one.  Stores the first sector allocated in *SECTORP
+   and returns how many were, or 0 if out of disk space or
+   memory.  The new sectors are zeroed before readers can see them.
+   INODE must be locked. */
+static size_t
+inode_fill_hole (struct inode *inode, size_t idx, size_t ofs, size_t cnt,
+                 disk_sector_t *sectorp)
+{
+  struct inode_extent *e;
+  struct inode_extent hole = inode->extents[idx];
+  size_t before = ofs - hole.ofs, after, add, i;
+  disk_sector_t sector;
 
+  ASSERT (hole.start == HOLE_SECTOR);
+  ASSERT (ofs >= hole.ofs && ofs + cnt <= hole.ofs + hole.length);
+
+  /* Room for the hole to split in three, on disk and in memory,
+     before anything changes. */
+  if (!inode_extent_room (inode, 2) || !inode_reserve_spill (inode, 2))
+    return 0;
+  while (!free_map_allocate (cnt, &sector))
+    {
+      if (cnt == 1)
+        return 0;
+      cnt /= 2;
     }
-  }
-  
-  inode->ptr_idx = idx;
-  inode->is_allocated = 1;
-  return 1;
+  for (i = 0; i < cnt; i++)
+    inode_zero_sector (inode, sector + i);
+  after = hole.length - before - cnt;
+
+  /* Replace the hole by [hole BEFORE][data CNT][hole AFTER],
+     leaving out the empty holes.  Readers see either the hole or
+     the finished split. */
+  lock_acquire (&inode->map_lock);
+  add = (before > 0) + (after > 0);
+  e = inode->extents;
+  memmove (&e[idx + 1 + add], &e[idx + 1],
+           (inode->extent_cnt - idx - 1) * sizeof *e);
+  inode->extent_cnt += add;
+  i = idx;
+  if (before > 0)
+    {
+      e[i].start = HOLE_SECTOR;
+      e[i].length = before;
+      e[i].ofs = hole.ofs;
+      i++;
+    }
+  e[i].start = sector;
+  e[i].length = cnt;
+  e[i].ofs = ofs;
+  if (after > 0)
+    {
+      e[i + 1].start = HOLE_SECTOR;
+      e[i + 1].length = after;
+      e[i + 1].ofs = ofs + cnt;
+    }
+
+  /* The new run may continue the data extents on either side. */
+  if (i + 1 < inode->extent_cnt && extent_joins (&e[i], e[i + 1].start))
+    {
+      e[i].length += e[i + 1].length;
+      memmove (&e[i + 1], &e[i + 2],
+               (inode->extent_cnt - i - 2) * sizeof *e);
+      inode->extent_cnt--;
+    }
+  if (i > 0 && extent_joins (&e[i - 1], e[i].start))
+    {
+      e[i - 1].length += e[i].length;
+      memmove (&e[i], &e[i + 1], (inode->extent_cnt - i - 1) * sizeof *e);
+      inode->extent_cnt--;
+    }
+  inode->extent_hint = 0;
+  lock_release (&inode->map_lock);
+
+  *sectorp = sector;
+  return cnt;
+}
+
+/* Fills the hole in INODE at byte POS with zeroed sectors, taking
+   in as much of the following SIZE bytes as lies in the same hole,
+   up to FILL_RUN_MAX sectors, and returns the sector now holding
+   POS.  Returns HOLE_SECTOR if out of disk space or memory. */
+static disk_sector_t
+inode_fill_at (struct inode *inode, off_t pos, off_t size)
+{
+  size_t ofs = pos / DISK_SECTOR_SIZE;
+  size_t end = DIV_ROUND_UP (pos + size, DISK_SECTOR_SIZE);
+  size_t idx, cnt;
+  struct inode_extent e;
+  disk_sector_t sector;
+
+  /* Holding INODE's lock keeps other writers from changing the
+     extents, so E stays current after MAP_LOCK is let go. */
+  inode_lock_acquire (inode);
+  lock_acquire (&inode->map_lock);
+  idx = find_extent (inode, ofs);
+  e = inode->extents[idx];
+  lock_release (&inode->map_lock);
+  if (e.start != HOLE_SECTOR)
+    {
+      /* Another writer filled it first. */
+      inode_lock_release (inode);
+      return e.start + (ofs - e.ofs);
+    }
+  if (end > e.ofs + e.length)
+    end = e.ofs + e.length;
+  if (end - ofs > FILL_RUN_MAX)
+    end = ofs + FILL_RUN_MAX;
+
+  cnt = inode_fill_hole (inode, idx, ofs, end - ofs, &sector);
+  inode_lock_release (inode);
+  return cnt > 0 ? sector : HOLE_SECTOR;
 }
 
 /* Initializes an inode with LENGTH bytes of data and
@@ -245,54 +669,35 @@ bool
 inode_create (disk_sector_t sector, off_t length, bool is_dir)
 {
   // printf("inode create start\n");
-  struct inode_disk *disk_inode = NULL;
-  bool success = false;
+  struct inode *inode;
+  bool success;
 
   ASSERT (length >= 0);
 
   /* If this assertion fails, the inode structure is not exactly
      one sector in size, and you should fix that. */
-  ASSERT (sizeof *disk_inode == DISK_SECTOR_SIZE);
+  ASSERT (sizeof (struct inode_disk) == DISK_SECTOR_SIZE);
+  ASSERT (sizeof (struct extent_block) == DISK_SECTOR_SIZE);
 
-  disk_inode = calloc (1, sizeof *disk_inode);
-  if (disk_inode != NULL)
-    {
-      if(length > FILE_SIZE_MAX) length = FILE_SIZE_MAX;
-      disk_inode->length = length;
-      disk_inode->magic = INODE_MAGIC;
-      disk_inode -> is_allocated = 1;
-      if(is_dir) disk_inode->is_dir = 1;
-      else disk_inode->is_dir = 0;
-
-      /* need to allocate */
-      struct inode* inode = malloc(sizeof(struct inode));
-      inode->length = 0;
-      inode->is_allocated = 0;
-      inode->ptr_idx = 0;
-      inode->indir_idx = 0;
-      inode->double_indir_idx = 0;
-      if(is_dir) inode->is_dir = 1;
-      else inode->is_dir = 0;
-
-      if(inode_grow(inode, length) == -1){
-        free(disk_inode);
-        return success;
-      }
-
-      memcpy(&(disk_inode->ptrs), &(inode->ptrs), sizeof(disk_sector_t) * NUM_PTRS);
-      disk_inode->double_indir_idx = inode->double_indir_idx;
-      disk_inode->indir_idx = inode->indir_idx;
-      disk_inode->ptr_idx = inode->ptr_idx;
-      
-      free(inode);
+  if(length > FILE_SIZE_MAX) length = FILE_SIZE_MAX;
 
-      disk_write(filesys_disk, sector, disk_inode);
-
-      success = true;
+  /* need to allocate */
+  inode = calloc (1, sizeof *inode);
+  if (inode == NULL)
+    return false;
+  inode->sector = sector;
+  lock_init (&inode->map_lock);
+  if(is_dir) inode->is_dir = 1;
+  else inode->is_dir = 0;
 
-      free (disk_inode);
-    }
+  success = inode_grow (inode, length);
+  if (success)
+    inode_store (inode, length, true);
+  else
+    inode_release_blocks (inode);
 
+  inode_free_extents (inode);
+  free(inode);
   return success;
 }
 
@@ -319,10 +724,11 @@ inode_open (disk_sector_t sector)
     }
 
   /* Allocate memory. */
-  inode = malloc (sizeof *inode);
-  lock_init(&inode->lock);
+  inode = calloc (1, sizeof *inode);
   if (inode == NULL)
     return NULL;
+  lock_init(&inode->lock);
+  lock_init (&inode->map_lock);
 
   /* Initialize. */
   list_push_front (&open_inodes, &inode->elem);
@@ -331,21 +737,31 @@ inode_open (disk_sector_t sector)
   inode->deny_write_cnt = 0;
   inode->removed = false;
 
-  struct inode_disk* inode_disk = malloc(sizeof(struct inode_disk));
-  // printf("sector : %d %d\n", inode->sector, sector);
-  disk_read (filesys_disk, inode->sector, inode_disk);
+  struct buffer_cache* block = cache_get (inode->sector, CACHE_META);
+  const struct inode_disk* inode_disk = (const struct inode_disk *) block->data;
+  size_t extent_cnt = inode_disk->extent_cnt;
+  size_t inline_cnt = extent_cnt < EXTENTS_INLINE ? extent_cnt : EXTENTS_INLINE;
+  disk_sector_t spill = inode_disk->spill;
+  bool success;
+
   inode->length = inode_disk->length;
   inode->length_shown = inode_disk->length;
   inode->is_allocated = inode_disk->is_allocated;
-  inode->indir_idx = inode_disk->indir_idx;
-  inode->double_indir_idx = inode_disk->double_indir_idx;
-  inode->ptr_idx = inode_disk->ptr_idx;
 
   inode->is_dir = inode_disk->is_dir;
   inode->parent = inode_disk->parent;
-  memcpy(&(inode->ptrs), &(inode_disk->ptrs), sizeof(disk_sector_t) * NUM_PTRS );
+  success = inode_load_extents (inode, inode_disk->extents, inline_cnt);
+  cache_put (block, false);
 
-  free(inode_disk);
+  /* The extent blocks are read through the cache as well, so only
+     once the inode's own sector is put back. */
+  if (!success || !inode_load_spill (inode, spill, extent_cnt - inline_cnt))
+    {
+      list_remove (&inode->elem);
+      inode_free_extents (inode);
+      free (inode);
+      return NULL;
+    }
   return inode;
 }
 
@@ -386,75 +802,11 @@ inode_close (struct inode *inode)
         {
           // printf("remove!\n");
           free_map_release (inode->sector, 1);
-          size_t sectors = bytes_to_sectors(inode_length(inode));
-          /* need to deallocate */
-          if(sectors != 0){
-            int index = 0;
-            disk_sector_t inner_ptr[PTR_PER_BLOCK];
-            disk_sector_t double_inner_ptr[PTR_PER_BLOCK];
-            for(; index<NUM_PTRS; index++){
-              if(sectors == 0) break;
-              else if(index > inode->ptr_idx) break;
-
-              if(index < NUM_PTRS_DIR){
-                free_map_release(inode->ptrs[index], 1);
-                sectors -= 1;
-              }
-
-              else if(index < NUM_PTRS_DIR + NUM_PTRS_INDIR){
-                disk_read(filesys_disk, inode->ptrs[index], &inner_ptr);
-                int i=0;
-                for(; i<PTR_PER_BLOCK; i++){ 
-                  free_map_release(inner_ptr[i], 1);
-                  sectors -= 1;
-                  if(sectors == 0) break;
-                }
-                free_map_release(inode->ptrs[index], 1);
-              }
-
-              else if(index < NUM_PTRS_DIR + NUM_PTRS_INDIR + NUM_PTRS_DOUBLE){
-                disk_read(filesys_disk, inode->ptrs[index], &inner_ptr);
-                int i=0;
-                for(; i<PTR_PER_BLOCK; i++){
-                  disk_read(filesys_disk, inner_ptr[i], &double_inner_ptr);
-                  int j=0;
-                  for(; j<PTR_PER_BLOCK; j++){
-                    free_map_release(double_inner_ptr[j], 1);
-                    sectors -= 1;
-                    if(sectors == 0) break;
-                  }
-                  free_map_release(inner_ptr[i], 1);
-                  if(sectors==0) break;
-                }
-                free_map_release(inode->ptrs[index], 1);
-              }
-
-              else ASSERT(0);
-              
-              // index += 1;
-            }
-          }
-          /* deallocate done */
-
-          // free_map_release (inode->start,
-          //                   bytes_to_sectors (inode->length)); 
+          inode_release_blocks (inode);
         }
-      else{
-        struct inode_disk* inode_disk = malloc(sizeof(struct inode_disk));
-
-        inode_disk->length = inode->length;
-        inode_disk->magic = INODE_MAGIC;
-        inode_disk->is_allocated = inode->is_allocated;
-        inode_disk->indir_idx = inode->indir_idx;
-        inode_disk->double_indir_idx = inode->double_indir_idx;
-        inode_disk->ptr_idx = inode->ptr_idx;
-        inode_disk->is_dir = inode->is_dir;
-        inode_disk->parent = inode->parent;
-        memcpy(&(inode_disk->ptrs), &(inode->ptrs), sizeof(disk_sector_t) * NUM_PTRS);
-        disk_write(filesys_disk, inode->sector, inode_disk);
-
-        free(inode_disk);
-      }
+      else
+        inode_store (inode, inode->length, false);
+      inode_free_extents (inode);
       free (inode); 
     }
 }
@@ -495,7 +847,11 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
       if (chunk_size <= 0)
         break;
       // printf("sector idx in read : %d\n", sector_idx);
-      cache_read(sector_idx, buffer, bytes_read, sector_ofs, chunk_size);
+      if (sector_idx == HOLE_SECTOR)
+        memset (buffer + bytes_read, 0, chunk_size);
+      else
+        cache_read(sector_idx, buffer, bytes_read, sector_ofs, chunk_size,
+                   inode_cache_type (inode));
     
       /* Advance. */
       size -= chunk_size;
@@ -505,6 +861,53 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
 
   return bytes_read;
 }
+
+/* Updates read-ahead state RA for a read of SIZE bytes at OFFSET
+   in INODE and queues the sectors following the read for
+   asynchronous prefetch into the buffer cache.
+   A read that starts where the previous one ended doubles the
+   window, up to READ_AHEAD_MAX sectors; any other read halves it,
+   so random access stops prefetching after a few reads. */
+void
+inode_read_ahead (struct inode *inode, struct read_ahead *ra,
+                  off_t offset, off_t size)
+{
+  off_t end = offset + size;
+  off_t limit, pos;
+
+  if (offset == ra->next_ofs)
+    {
+      if (ra->window == 0)
+        ra->window = READ_AHEAD_MIN;
+      else if (ra->window * 2 <= READ_AHEAD_MAX)
+        ra->window *= 2;
+    }
+  else
+    {
+      ra->window /= 2;
+      ra->ahead_ofs = 0;
+    }
+  ra->next_ofs = end;
+  if (ra->window == 0 || size <= 0)
+    return;
+
+  /* The sector holding END, if partially read, is cached already. */
+  limit = end + ra->window * DISK_SECTOR_SIZE;
+  if (limit > inode->length_shown)
+    limit = inode->length_shown;
+  pos = ROUND_UP (end, DISK_SECTOR_SIZE);
+  if (pos < ra->ahead_ofs)
+    pos = ra->ahead_ofs;
+  for (; pos < limit; pos += DISK_SECTOR_SIZE)
+    {
+      disk_sector_t sector = byte_to_sector (inode, pos);
+      if (sector != HOLE_SECTOR)
+        cache_read_ahead (sector);
+    }
+  if (pos > ra->ahead_ofs)
+    ra->ahead_ofs = pos;
+}
+
 bool
 inode_is_opened(struct inode* inode){
   return (inode->open_cnt > 1);
@@ -531,7 +934,8 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
   if(size+offset > inode_length(inode)){
     // printf("need to grow about %d!\n", size+offset);
 
-    if(inode_grow(inode, size+offset)==-1){
+    if(!inode_grow(inode, size+offset)){
+      if(!inode_is_dir(inode)) inode_lock_release(inode);
       return 0;
     }
 
@@ -570,7 +974,15 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
       if (chunk_size <= 0)
         break;
       // printf("sector idx in write : %d\n", sector_idx);
-      cache_write(sector_idx, buffer, bytes_written, sector_ofs, chunk_size);
+      if (sector_idx == HOLE_SECTOR)
+        {
+          /* First write to a hole. */
+          sector_idx = inode_fill_at (inode, offset, size);
+          if (sector_idx == HOLE_SECTOR)
+            break;
+        }
+      cache_write(sector_idx, (uint8_t *) buffer, bytes_written, sector_ofs,
+                  chunk_size, inode_cache_type (inode));
 
       if(inode->length_shown + chunk_size > inode_length(inode))  inode->length_shown = inode_length(inode);
       else inode->length_shown += chunk_size;
@@ -2,19 +2,30 @@
 #define FILESYS_INODE_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include "filesys/off_t.h"
 #include "devices/disk.h"
 
 struct bitmap;
 
+/* Per-open-file read-ahead state, see inode_read_ahead(). */
+struct read_ahead
+  {
+    off_t next_ofs;             /* Where a sequential read would start. */
+    off_t ahead_ofs;            /* End of the range already queued. */
+    size_t window;              /* Read-ahead window in sectors. */
+  };
+
 void inode_init (void);
 bool inode_create (disk_sector_t, off_t, bool);
 struct inode *inode_open (disk_sector_t);
 struct inode *inode_reopen (struct inode *);
 disk_sector_t inode_get_inumber (const struct inode *);
+disk_sector_t inode_byte_to_sector (struct inode *, off_t pos);
 void inode_close (struct inode *);
 void inode_remove (struct inode *);
 off_t inode_read_at (struct inode *, void *, off_t size, off_t offset);
+void inode_read_ahead (struct inode *, struct read_ahead *, off_t offset, off_t size);
 off_t inode_write_at (struct inode *, const void *, off_t size, off_t offset);
 void inode_deny_write (struct inode *);
 void inode_allow_write (struct inode *);
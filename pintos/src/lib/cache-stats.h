@@ -0,0 +1,40 @@
+#ifndef __LIB_CACHE_STATS_H
+#define __LIB_CACHE_STATS_H
+
+/* Buffer cache statistics, shared between the kernel and user
+   programs through the cache_stats system call. */
+
+/* Kinds of sectors the buffer cache tells apart. */
+enum cache_type
+  {
+    CACHE_DATA,                 /* Regular file data. */
+    CACHE_META,                 /* Inodes, pointer blocks, directories,
+                                   free map. */
+    CACHE_TYPE_CNT
+  };
+
+/* Counters kept for each kind of sector. */
+struct cache_type_stats
+  {
+    long long hits;             /* Lookups satisfied from the cache. */
+    long long load_waits;       /* Lookups that found the sector still
+                                   being read in, and waited for it. */
+    long long misses;           /* Lookups that read the disk. */
+    long long evictions;        /* Entries reused for another sector. */
+    long long dirty_evictions;  /* ...of which had to be written first. */
+    long long flushes;          /* Sectors written back by write-behind. */
+  };
+
+/* Buffer cache statistics. */
+struct cache_stats
+  {
+    struct cache_type_stats type[CACHE_TYPE_CNT];
+    long long read_ahead;       /* Sectors loaded by read-ahead. */
+    long long blank_loads;      /* Misses overwritten without a disk read. */
+    long long ghost_hits;       /* 2Q misses on recently evicted sectors. */
+    long long flush_runs;       /* Write-behind transfers issued. */
+    long long lock_waits;       /* Contended cache lock acquisitions. */
+    long long lock_wait_ticks;  /* Timer ticks spent waiting for it. */
+  };
+
+#endif /* lib/cache-stats.h */
@@ -0,0 +1,50 @@
+#ifndef __LIB_DISK_STATS_H
+#define __LIB_DISK_STATS_H
+
+/* Disk statistics, shared between the kernel and user programs
+   through the disk_stats system call. */
+
+/* Who a disk request was made for. */
+enum disk_class
+  {
+    DISK_OTHER,                 /* Anything not listed below. */
+    DISK_FS_DATA,               /* Regular file data. */
+    DISK_FS_META,               /* Inodes, directories, free map. */
+    DISK_SWAP_IN,               /* Pages read back from swap. */
+    DISK_SWAP_OUT,              /* Pages written out to swap. */
+    DISK_WRITE_BEHIND,          /* Background cache write-back, served
+                                   only when nothing else waits. */
+    DISK_CLASS_CNT
+  };
+
+/* Latency histogram buckets.  Bucket 0 counts latencies under
+   1 us, bucket I > 0 those of at least 2**(I-1) us and under
+   2**I us, and the last bucket also counts all longer ones. */
+#define DISK_HIST_CNT 20
+
+/* Counters kept for each class of request. */
+struct disk_class_stats
+  {
+    long long requests;         /* Requests completed. */
+    long long sectors;          /* Sectors they transferred. */
+    long long wait_us;          /* Total time queued before starting. */
+    long long service_us;       /* Total time from start to completion. */
+  };
+
+/* Statistics for one disk. */
+struct disk_stats
+  {
+    long long read_cnt;         /* Number of sectors read. */
+    long long write_cnt;        /* Number of sectors written. */
+    long long command_cnt;      /* Number of commands they took. */
+    long long merge_cnt;        /* Requests merged into another's command. */
+    struct disk_class_stats class[DISK_CLASS_CNT];
+    long long wait_hist[DISK_HIST_CNT];         /* Queue wait. */
+    long long service_hist[DISK_HIST_CNT];      /* Service time. */
+    long long depth;            /* Requests submitted but not completed. */
+    long long depth_max;        /* Highest DEPTH seen. */
+    long long depth_sum;        /* Sum of DEPTH seen by each new request,
+                                   not counting itself. */
+  };
+
+#endif /* lib/disk-stats.h */
@@ -0,0 +1,13 @@
+#ifndef __LIB_FS_STATS_H
+#define __LIB_FS_STATS_H
+
+/* File system space, shared between the kernel and user programs
+   through the statfs system call. */
+struct fs_stats
+  {
+    long long sector_size;      /* Bytes per sector. */
+    long long total_sectors;    /* Sectors on the file system disk. */
+    long long free_sectors;     /* Sectors not allocated. */
+  };
+
+#endif /* lib/fs-stats.h */
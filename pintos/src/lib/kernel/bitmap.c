@@ -3,6 +3,7 @@
 #include <limits.h>
 #include <round.h>
 #include <stdio.h>
+#include <string.h>
 #include "threads/malloc.h"
 #ifdef FILESYS
 #include "filesys/file.h"
@@ -359,6 +360,37 @@ bitmap_write (const struct bitmap *b, struct file *file)
   off_t size = byte_cnt (b->bit_cnt);
   return file_write_at (file, b->bits, size, 0) == size;
 }
+
+/* Copies the SIZE bytes of B's file image that start at byte OFS
+   into BUF.  Bytes past the end of the image read as zeros. */
+void
+bitmap_get_image (const struct bitmap *b, size_t ofs, void *buf,
+                  size_t size)
+{
+  size_t total = byte_cnt (b->bit_cnt);
+  size_t cnt = ofs < total ? total - ofs : 0;
+
+  if (cnt > size)
+    cnt = size;
+  memcpy (buf, (const uint8_t *) b->bits + ofs, cnt);
+  memset ((uint8_t *) buf + cnt, 0, size - cnt);
+}
+
+/* Copies SIZE bytes from BUF into B's file image starting at byte
+   OFS.  Bytes that fall past the end of the image are ignored. */
+void
+bitmap_set_image (struct bitmap *b, size_t ofs, const void *buf,
+                  size_t size)
+{
+  size_t total = byte_cnt (b->bit_cnt);
+
+  if (ofs >= total)
+    return;
+  if (size > total - ofs)
+    size = total - ofs;
+  memcpy ((uint8_t *) b->bits + ofs, buf, size);
+  b->bits[elem_cnt (b->bit_cnt) - 1] &= last_mask (b);
+}
 #endif /* FILESYS */
 
 /* Debugging. */
@@ -28,7 +28,12 @@ enum
     SYS_MKDIR,                  /* Create a directory. */
     SYS_READDIR,                /* Reads a directory entry. */
     SYS_ISDIR,                  /* Tests if a fd represents a directory. */
-    SYS_INUMBER                 /* Returns the inode number for a fd. */
+    SYS_INUMBER,                /* Returns the inode number for a fd. */
+
+    /* Instrumentation. */
+    SYS_CACHE_STATS,            /* Reads buffer cache statistics. */
+    SYS_DISK_STATS,             /* Reads a disk's statistics. */
+    SYS_STATFS                  /* Reads file system space usage. */
   };
 
 #endif /* lib/syscall-nr.h */
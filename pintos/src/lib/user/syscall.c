@@ -182,3 +182,21 @@ inumber (int fd)
 {
   return syscall1 (SYS_INUMBER, fd);
 }
+
+bool
+cache_stats (struct cache_stats *stats)
+{
+  return syscall1 (SYS_CACHE_STATS, stats);
+}
+
+bool
+disk_stats (const char *name, struct disk_stats *stats)
+{
+  return syscall2 (SYS_DISK_STATS, name, stats);
+}
+
+bool
+statfs (struct fs_stats *stats)
+{
+  return syscall1 (SYS_STATFS, stats);
+}
@@ -3,6 +3,9 @@
 
 #include <stdbool.h>
 #include <debug.h>
+#include <cache-stats.h>
+#include <disk-stats.h>
+#include <fs-stats.h>
 
 /* Process identifier. */
 typedef int pid_t;
@@ -45,4 +48,9 @@ bool readdir (int fd, char name[READDIR_MAX_LEN + 1]);
 bool isdir (int fd);
 int inumber (int fd);
 
+/* Instrumentation. */
+bool cache_stats (struct cache_stats *);
+bool disk_stats (const char *name, struct disk_stats *);
+bool statfs (struct fs_stats *);
+
 #endif /* lib/user/syscall.h */
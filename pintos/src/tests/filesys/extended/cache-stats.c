@@ -0,0 +1,40 @@
+/* Checks that cache_stats() counts hits when a file that was just
+   written is read back. */
+
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+static char buf[2048];
+
+static long long
+hits (const struct cache_stats *st) 
+{
+  return st->type[CACHE_DATA].hits + st->type[CACHE_META].hits;
+}
+
+void
+test_main (void) 
+{
+  const char *file_name = "testfile";
+  struct cache_stats before, after;
+  int fd;
+
+  CHECK (create (file_name, 0), "create \"%s\"", file_name);
+  CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+  CHECK (write (fd, buf, sizeof buf) == (int) sizeof buf,
+         "write \"%s\"", file_name);
+
+  CHECK (cache_stats (&before), "cache_stats");
+  msg ("read \"%s\"", file_name);
+  seek (fd, 0);
+  if (read (fd, buf, sizeof buf) != (int) sizeof buf)
+    fail ("read \"%s\" failed", file_name);
+  CHECK (cache_stats (&after), "cache_stats");
+  if (hits (&after) < hits (&before) + (long long) sizeof buf / 512)
+    fail ("cache hits went from %lld to %lld reading %zu cached bytes",
+          hits (&before), hits (&after), sizeof buf);
+
+  msg ("close \"%s\"", file_name);
+  close (fd);
+}
@@ -0,0 +1,16 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(cache-stats) begin
+(cache-stats) create "testfile"
+(cache-stats) open "testfile"
+(cache-stats) write "testfile"
+(cache-stats) cache_stats
+(cache-stats) read "testfile"
+(cache-stats) cache_stats
+(cache-stats) close "testfile"
+(cache-stats) end
+EOF
+pass;
@@ -0,0 +1,17 @@
+/* Checks that disk_stats() finds the file system disk by name and
+   counts the reads made to mount it, and rejects unknown names. */
+
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+void
+test_main (void) 
+{
+  struct disk_stats st;
+
+  CHECK (disk_stats ("hd0:1", &st), "disk_stats \"hd0:1\"");
+  if (st.read_cnt <= 0)
+    fail ("%lld sectors read from the file system disk", st.read_cnt);
+  CHECK (!disk_stats ("nosuchdisk", &st), "disk_stats \"nosuchdisk\"");
+}
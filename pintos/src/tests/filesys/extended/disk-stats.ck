@@ -0,0 +1,11 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(disk-stats) begin
+(disk-stats) disk_stats "hd0:1"
+(disk-stats) disk_stats "nosuchdisk"
+(disk-stats) end
+EOF
+pass;
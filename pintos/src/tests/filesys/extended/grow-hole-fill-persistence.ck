@@ -0,0 +1,11 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+use tests::random;
+my ($middle) = random_bytes (1000);
+my ($sector) = random_bytes (512);
+check_archive ({"testfile" => ["\0" x 10240 . $sector
+                               . "\0" x (30000 - 10752) . $middle
+                               . "\0" x (65536 - 31000)]});
+pass;
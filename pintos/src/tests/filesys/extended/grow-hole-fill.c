@@ -0,0 +1,35 @@
+/* Writes into the middle of a hole left by growing a file, and
+   into the hole before that write, then checks that the hole
+   around them still reads as zeros. */
+
+#include <random.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+static char buf[65536];
+
+void
+test_main (void) 
+{
+  const char *file_name = "testfile";
+  int fd;
+
+  random_bytes (buf + 30000, 1000);
+  random_bytes (buf + 10240, 512);
+  CHECK (create (file_name, 0), "create \"%s\"", file_name);
+  CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+  msg ("seek \"%s\"", file_name);
+  seek (fd, sizeof buf - 1);
+  CHECK (write (fd, buf + sizeof buf - 1, 1) == 1,
+         "write end of \"%s\"", file_name);
+  seek (fd, 30000);
+  CHECK (write (fd, buf + 30000, 1000) == 1000,
+         "write middle of \"%s\"", file_name);
+  seek (fd, 10240);
+  CHECK (write (fd, buf + 10240, 512) == 512,
+         "write sector of \"%s\"", file_name);
+  msg ("close \"%s\"", file_name);
+  close (fd);
+  check_file (file_name, buf, sizeof buf);
+}
@@ -0,0 +1,43 @@
+/* Grows a file by writing one byte far past its end, then reads
+   back parts of the hole in between, which must read as zeros,
+   including a read that runs on into the byte written. */
+
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+static char buf[70000];
+static char zeros[30000];
+static char data[30000];
+
+void
+test_main (void) 
+{
+  const char *file_name = "testfile";
+  char byte = 0x55;
+  int fd;
+
+  buf[sizeof buf - 1] = byte;
+  CHECK (create (file_name, 0), "create \"%s\"", file_name);
+  CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+  msg ("seek \"%s\"", file_name);
+  seek (fd, sizeof buf - 1);
+  CHECK (write (fd, &byte, 1) == 1, "write \"%s\"", file_name);
+
+  msg ("read middle of hole");
+  seek (fd, 20001);
+  if (read (fd, data, sizeof data) != (int) sizeof data)
+    fail ("read %zu bytes at offset 20001 failed", sizeof data);
+  compare_bytes (data, zeros, sizeof data, 20001, file_name);
+
+  msg ("read end of hole");
+  seek (fd, sizeof buf - 1000);
+  if (read (fd, data, 1000) != 1000)
+    fail ("read 1000 bytes at offset %zu failed", sizeof buf - 1000);
+  compare_bytes (data, buf + sizeof buf - 1000, 1000, sizeof buf - 1000,
+                 file_name);
+
+  msg ("close \"%s\"", file_name);
+  close (fd);
+  check_file (file_name, buf, sizeof buf);
+}
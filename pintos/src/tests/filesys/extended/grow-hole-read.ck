@@ -0,0 +1,19 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(grow-hole-read) begin
+(grow-hole-read) create "testfile"
+(grow-hole-read) open "testfile"
+(grow-hole-read) seek "testfile"
+(grow-hole-read) write "testfile"
+(grow-hole-read) read middle of hole
+(grow-hole-read) read end of hole
+(grow-hole-read) close "testfile"
+(grow-hole-read) open "testfile" for verification
+(grow-hole-read) verified contents of "testfile"
+(grow-hole-read) close "testfile"
+(grow-hole-read) end
+EOF
+pass;
@@ -0,0 +1,39 @@
+/* Runs with the file system on a RAM disk, from -ramdisk-fs.
+   Checks that a file written in a new directory reads back, that
+   disk_stats() finds the RAM disk and counts the reads made to load
+   this program from it, and that nothing is written to the ATA
+   file system disk. */
+
+#include <random.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+static char buf[5678];
+
+void
+test_main (void) 
+{
+  const char *file_name = "/a/ramfile";
+  struct disk_stats st;
+  int fd;
+
+  random_init (0);
+  random_bytes (buf, sizeof buf);
+
+  CHECK (mkdir ("/a"), "mkdir \"/a\"");
+  CHECK (create (file_name, 0), "create \"%s\"", file_name);
+  CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+  CHECK (write (fd, buf, sizeof buf) == (int) sizeof buf,
+         "write \"%s\"", file_name);
+  msg ("close \"%s\"", file_name);
+  close (fd);
+  check_file (file_name, buf, sizeof buf);
+
+  CHECK (disk_stats ("ramfs", &st), "disk_stats \"ramfs\"");
+  if (st.read_cnt <= 0)
+    fail ("%lld sectors read from the RAM disk", st.read_cnt);
+  CHECK (disk_stats ("hd0:1", &st), "disk_stats \"hd0:1\"");
+  if (st.write_cnt != 0)
+    fail ("%lld sectors written to the ATA disk", st.write_cnt);
+}
@@ -0,0 +1,19 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(ram-fs) begin
+(ram-fs) mkdir "/a"
+(ram-fs) create "/a/ramfile"
+(ram-fs) open "/a/ramfile"
+(ram-fs) write "/a/ramfile"
+(ram-fs) close "/a/ramfile"
+(ram-fs) open "/a/ramfile" for verification
+(ram-fs) verified contents of "/a/ramfile"
+(ram-fs) close "/a/ramfile"
+(ram-fs) disk_stats "ramfs"
+(ram-fs) disk_stats "hd0:1"
+(ram-fs) end
+EOF
+pass;
@@ -0,0 +1,41 @@
+/* Checks that statfs() reports free space that drops when a file
+   is written and comes back once it is removed. */
+
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+static char buf[20480];
+
+void
+test_main (void) 
+{
+  const char *file_name = "testfile";
+  struct fs_stats before, during, after;
+  int fd;
+
+  CHECK (statfs (&before), "statfs");
+  if (before.sector_size != 512)
+    fail ("sector size is %lld, not 512", before.sector_size);
+  if (before.free_sectors <= 0 || before.free_sectors > before.total_sectors)
+    fail ("%lld of %lld sectors free", before.free_sectors,
+          before.total_sectors);
+
+  CHECK (create (file_name, 0), "create \"%s\"", file_name);
+  CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+  CHECK (write (fd, buf, sizeof buf) == (int) sizeof buf,
+         "write \"%s\"", file_name);
+  msg ("close \"%s\"", file_name);
+  close (fd);
+
+  CHECK (statfs (&during), "statfs");
+  if (during.free_sectors > before.free_sectors - (long long) sizeof buf / 512)
+    fail ("free sectors went from %lld to %lld after writing %zu bytes",
+          before.free_sectors, during.free_sectors, sizeof buf);
+
+  CHECK (remove (file_name), "remove \"%s\"", file_name);
+  CHECK (statfs (&after), "statfs");
+  if (after.free_sectors != before.free_sectors)
+    fail ("free sectors went from %lld to %lld after removing \"%s\"",
+          before.free_sectors, after.free_sectors, file_name);
+}
@@ -0,0 +1,17 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(statfs) begin
+(statfs) statfs
+(statfs) create "testfile"
+(statfs) open "testfile"
+(statfs) write "testfile"
+(statfs) close "testfile"
+(statfs) statfs
+(statfs) remove "testfile"
+(statfs) statfs
+(statfs) end
+EOF
+pass;
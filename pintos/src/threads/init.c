@@ -36,6 +36,7 @@
 #include "devices/disk.h"
 #include "filesys/filesys.h"
 #include "filesys/fsutil.h"
+#include "filesys/cache.h"
 #endif
 
 
@@ -246,6 +247,43 @@ parse_options (char **argv)
 #ifdef FILESYS
       else if (!strcmp (name, "-f"))
         format_filesys = true;
+      else if (!strcmp (name, "-cache"))
+        {
+          int entries = value != NULL ? atoi (value) : 0;
+          if (entries <= 0)
+            PANIC ("-cache needs a positive number of entries");
+          cache_size = entries;
+        }
+      else if (!strcmp (name, "-dma"))
+        disk_dma = true;
+      else if (!strcmp (name, "-ramdisk-fs") || !strcmp (name, "-ramdisk-swap"))
+        {
+          int kb = value != NULL ? atoi (value) : 0;
+          if (kb <= 0)
+            PANIC ("%s needs a positive size in kB", name);
+          disk_ram_size[!strcmp (name, "-ramdisk-fs")
+                        ? DISK_ROLE_FS : DISK_ROLE_SWAP] = kb;
+        }
+      else if (!strcmp (name, "-swap"))
+        {
+          if (value == NULL || *value == '\0')
+            PANIC ("-swap needs a list of disks");
+          swap_disk_names = value;
+        }
+      else if (!strcmp (name, "-virtio"))
+        {
+          if (value != NULL && !strcmp (value, "fs"))
+            disk_virtio_role = DISK_ROLE_FS;
+          else if (value != NULL && !strcmp (value, "swap"))
+            disk_virtio_role = DISK_ROLE_SWAP;
+          else
+            PANIC ("-virtio needs `fs' or `swap'");
+        }
+      else if (!strcmp (name, "-cache-policy"))
+        {
+          if (value == NULL || !cache_policy_parse (value))
+            PANIC ("-cache-policy needs `clock' or `2q'");
+        }
 #endif
       else if (!strcmp (name, "-rs"))
         random_init (atoi (value));
@@ -354,6 +392,15 @@ usage (void)
           "  -h                 Print this help message and power off.\n"
           "  -q                 Power off VM after actions or on panic.\n"
           "  -f                 Format file system disk during startup.\n"
+#ifdef FILESYS
+          "  -cache=N           Use N sectors of buffer cache (default 64).\n"
+          "  -cache-policy=P    Replace cache entries by P, clock or 2q.\n"
+          "  -dma               Use bus-master DMA for the IDE disks.\n"
+          "  -ramdisk-fs=KB     Keep the file system on a KB kB RAM disk.\n"
+          "  -ramdisk-swap=KB   Swap to a KB kB RAM disk.\n"
+          "  -virtio=ROLE       Use the virtio disk for ROLE, fs or swap.\n"
+          "  -swap=DISK,...     Stripe swap across DISKs, e.g. hd1:1,hd1:0.\n"
+#endif
           "  -rs=SEED           Set random number seed to SEED.\n"
           "  -mlfqs             Use multi-level feedback queue scheduler.\n"
 #ifdef USERPROG
@@ -396,6 +443,7 @@ print_stats (void)
   thread_print_stats ();
 #ifdef FILESYS
   disk_print_stats ();
+  cache_print_stats ();
 #endif
   console_print_stats ();
   kbd_print_stats ();
@@ -16,6 +16,8 @@
 #include "vm/page.h"
 #include "vm/frame.h"
 #include "filesys/inode.h"
+#include "filesys/cache.h"
+#include "filesys/free-map.h"
 
 typedef int pid_t;
 
@@ -43,6 +45,9 @@ static bool mkdir (char *dir);
 static bool readdir (int fd, char *name);
 static bool isdir (int fd);
 static int inumber (int fd);
+static bool cache_stats (struct cache_stats *stats, void* esp);
+static bool disk_stats (const char *name, struct disk_stats *stats, void* esp);
+static bool statfs (struct fs_stats *stats, void* esp);
 
 
 
@@ -249,6 +254,22 @@ syscall_handler (struct intr_frame *f)
 				argv0 = *p_argv(if_esp+4);
 				f->eax = inumber((int)argv0);
 				break;
+
+			case SYS_CACHE_STATS:      /* Read buffer cache statistics. */
+				argv0 = *p_argv(if_esp+4);
+				f->eax = cache_stats((struct cache_stats *)argv0, if_esp);
+				break;
+
+			case SYS_DISK_STATS:      /* Read a disk's statistics. */
+				argv0 = *p_argv(if_esp+4);
+				argv1 = *p_argv(if_esp+8);
+				f->eax = disk_stats((const char *)argv0, (struct disk_stats *)argv1, if_esp);
+				break;
+
+			case SYS_STATFS:          /* Read file system space usage. */
+				argv0 = *p_argv(if_esp+4);
+				f->eax = statfs((struct fs_stats *)argv0, if_esp);
+				break;
 		default:
 			printf("other syscall came!\n");
 				ASSERT(0);
@@ -784,4 +805,53 @@ is_bad_pointer(const char* ptr){
 	void* ptr_page = pagedir_get_page(thread_current()->pagedir, ptr);
 	if(!ptr_page)		return true;
 	else 				return false;
-}
\ No newline at end of file
+}
+
+bool cache_stats (struct cache_stats *stats, void* esp){
+	struct cache_stats st;
+
+	if (stats == NULL || !is_user_vaddr(stats) || !is_user_vaddr(stats + 1))
+		exit(-1);
+
+	/* Copied out only after the cache lock is dropped, since touching
+	   STATS may fault and page in through the cache. */
+	cache_get_stats(&st);
+	check_page(stats, sizeof *stats, esp);
+	memcpy(stats, &st, sizeof st);
+	return true;
+}
+
+bool disk_stats (const char *name, struct disk_stats *stats, void* esp){
+	struct disk *d;
+	struct disk_stats st;
+
+	if (!string_validate(name))	exit(-1);
+	if (stats == NULL || !is_user_vaddr(stats) || !is_user_vaddr(stats + 1))
+		exit(-1);
+
+	/* By name, so that RAM disks and vda can be read as well as IDE
+	   disks. */
+	d = disk_find(name);
+	if (d == NULL) return false;
+
+	/* disk_get_stats() copies with interrupts off, where a page fault
+	   on STATS would be fatal. */
+	disk_get_stats(d, &st);
+	check_page(stats, sizeof *stats, esp);
+	memcpy(stats, &st, sizeof st);
+	return true;
+}
+
+bool statfs (struct fs_stats *stats, void* esp){
+	struct fs_stats st;
+
+	if (stats == NULL || !is_user_vaddr(stats) || !is_user_vaddr(stats + 1))
+		exit(-1);
+
+	/* As in cache_stats(), STATS is not touched under the free map's
+	   lock. */
+	free_map_get_stats(&st);
+	check_page(stats, sizeof *stats, esp);
+	memcpy(stats, &st, sizeof st);
+	return true;
+}
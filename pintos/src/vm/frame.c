@@ -85,60 +85,73 @@ search_frame_table_entry (void* frame){
   return NULL;
 }
 
+/* Evicts up to SWAP_CLUSTER frames whose pages have not been
+   accessed lately, giving accessed ones a second chance, so that
+   the pages among them that must go to swap are written together. */
 bool
 evict_frame (void){
     struct list_elem* e;
     struct frame_table_entry* fte;
-    if(!list_empty(&frame_table)){
-        for(e = list_begin(&frame_table); e != list_end(&frame_table); e = list_next(e)){
+    struct frame_table_entry* victims[SWAP_CLUSTER];
+    void* frames[SWAP_CLUSTER];
+    tid_t owners[SWAP_CLUSTER];
+    disk_sector_t sectors[SWAP_CLUSTER];
+    bool dirty[SWAP_CLUSTER];
+    size_t victim_cnt = 0, swap_cnt = 0, swapped, i;
+    int pass;
+
+    /* second chance: the first pass clears accessed bits */
+    for(pass = 0; pass < 2 && victim_cnt == 0; pass++){
+        for(e = list_begin(&frame_table);
+            e != list_end(&frame_table) && victim_cnt < SWAP_CLUSTER;
+            e = list_next(e)){
             fte = list_entry(e, struct frame_table_entry, elem_table_list);
             if(!pagedir_is_accessed(fte->owner->pagedir, fte->spte->user_vaddr)){
                 if(fte->spte->file_type == TYPE_MMAP) ASSERT(0);
-
-                if(pagedir_is_dirty(fte->owner->pagedir, fte->spte->user_vaddr) || fte->spte->file_type == TYPE_SWAP){
-                    fte->spte->file_type = TYPE_SWAP;
-                    fte->spte->swap_num = swap_out(fte->frame);
-                    fte->spte->is_swapped = true;
-                }
-                list_remove(&fte->elem_table_list);
-                pagedir_clear_page(fte->owner->pagedir, fte->spte->user_vaddr);
-                palloc_free_page(fte->frame);
-                
-                fte->spte->loaded = false;
-                free(fte);
-
-                return true;
-            } 
+                victims[victim_cnt++] = fte;
+            }
             else{
                 pagedir_set_accessed(fte->owner->pagedir, fte->spte->user_vaddr, false);
             }
         }
+    }
+    if(victim_cnt == 0) return false;
+
+    /* Unmap every victim before any is written out.  Its owner then
+       faults, and waits for lock_frame, instead of changing a page
+       whose old contents are being saved or dropped. */
+    for(i = 0; i < victim_cnt; i++){
+        fte = victims[i];
+        dirty[i] = pagedir_is_dirty(fte->owner->pagedir, fte->spte->user_vaddr);
+        pagedir_clear_page(fte->owner->pagedir, fte->spte->user_vaddr);
+    }
 
-        /* second chance */
-        for(e = list_begin(&frame_table); e != list_end(&frame_table); e = list_next(e)){
-            fte = list_entry(e, struct frame_table_entry, elem_table_list);
-            if(!pagedir_is_accessed(fte->owner->pagedir, fte->spte->user_vaddr)){
-                if(pagedir_is_dirty(fte->owner->pagedir, fte->spte->user_vaddr) || fte->spte->file_type == TYPE_SWAP){
-                    fte->spte->file_type = TYPE_SWAP;
-                    fte->spte->swap_num = swap_out(fte->frame);
-                    fte->spte->is_swapped = true;
-                }
-
-                list_remove(&fte->elem_table_list);
-                pagedir_clear_page(fte->owner->pagedir, fte->spte->user_vaddr);
-                palloc_free_page(fte->frame);
+    for(i = 0; i < victim_cnt; i++){
+        fte = victims[i];
+        if(dirty[i] || fte->spte->file_type == TYPE_SWAP){
+            frames[swap_cnt] = fte->frame;
+            owners[swap_cnt] = fte->owner->tid;
+            swap_cnt++;
+        }
+    }
+    swap_out_cluster(frames, owners, swap_cnt, sectors);
+
+    swapped = 0;
+    for(i = 0; i < victim_cnt; i++){
+        fte = victims[i];
+        if(swapped < swap_cnt && frames[swapped] == fte->frame){
+            fte->spte->file_type = TYPE_SWAP;
+            fte->spte->swap_num = sectors[swapped++];
+            fte->spte->is_swapped = true;
+        }
 
-                fte->spte->loaded = false;
-                free(fte);
+        list_remove(&fte->elem_table_list);
+        palloc_free_page(fte->frame);
 
-                return true;
-            } 
-            else{
-                pagedir_set_accessed(fte->owner->pagedir, fte->spte->user_vaddr, false);
-            }
-        }   
+        fte->spte->loaded = false;
+        free(fte);
     }
-    return false;
+    return true;
 }
 
 void*
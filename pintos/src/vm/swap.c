@@ -1,81 +1,363 @@
 #include "vm/swap.h"
+#include <stdio.h>
+#include <string.h>
 #include "devices/disk.h"
+#include "threads/malloc.h"
+#include "threads/palloc.h"
 #include "threads/synch.h"
 // #include <bitmap.h>
 #include "threads/vaddr.h"
 #include "lib/kernel/bitmap.h"
 
+#define SECTORS_PER_PAGE (PGSIZE / DISK_SECTOR_SIZE)
+
+/* Most disks swap may be striped across. */
+#define SWAP_DISK_MAX 4
+
+/* A disk swap space is spread over.  Its slots are numbered
+   BASE...BASE + bitmap_size(USED) - 1 among all the swap slots, and
+   a page in slot N lives at sector N * SECTORS_PER_PAGE of the
+   concatenation of the swap disks, which is what swap_out_cluster()
+   hands out and swap_in() takes back.  All but DISK and BASE are
+   protected by swap_lock. */
+struct swap_disk {
+    struct disk* disk;
+    struct bitmap* used;        /* In-use slots. */
+    tid_t* owner;               /* Process each in-use slot's page is of. */
+    size_t base;                /* Number of this disk's first slot. */
+    size_t cursor;              /* Where the next slot search starts. */
+};
+
+static struct swap_disk swap_disks[SWAP_DISK_MAX];
+static size_t swap_disk_cnt;
+
+/* Disk chosen first when several are equally busy, so that
+   page-outs on an idle system still go round all of them. */
+static size_t swap_next_disk;
+
+/* Comma-separated names of the disks to swap to, e.g.
+   "hd1:1,hd1:0", or a null pointer for just the usual swap
+   disk.  Set by -swap. */
+const char* swap_disk_names;
+
+/* Swap cache: pages read from swap ahead of their faults, along
+   with a page that was.  Protected by swap_lock. */
+#define SWAP_CACHE_PAGES 16
+enum swap_cache_state {
+    SC_EMPTY,                   /* Unused. */
+    SC_LOADING,                 /* Being read from disk. */
+    SC_VALID                    /* Holds a copy of slot SLOT. */
+};
+struct swap_cache_entry {
+    enum swap_cache_state state;
+    size_t slot;
+    void* page;
+};
+static struct swap_cache_entry swap_cache[SWAP_CACHE_PAGES];
+static size_t swap_cache_hand;          /* Next entry to reuse. */
+static struct condition swap_cache_loaded;  /* Signaled when entries
+                                               stop being SC_LOADING. */
+
+static void add_swap_disk(struct disk* d);
+static struct swap_disk* find_swap_disk(size_t slot);
+static struct swap_disk* alloc_slots(size_t want, size_t* start, size_t* cnt);
+static void swap_transfer(struct swap_disk* sd, size_t slot, size_t cnt,
+                          void* pages[], bool write);
+static struct swap_cache_entry* swap_cache_find(size_t slot);
+static struct swap_cache_entry* swap_cache_claim(void);
+
 void 
 swap_init (void)
 {
+    size_t i;
 
-    swap_device = disk_get(1,1);
+    lock_init(&swap_lock);
+    cond_init(&swap_cache_loaded);
+    for(i = 0; i < SWAP_CACHE_PAGES; i++){
+        swap_cache[i].state = SC_EMPTY;
+        swap_cache[i].page = palloc_get_page(0);
+        if(swap_cache[i].page == NULL) PANIC("swap: out of memory");
+    }
 
-    swap_table = bitmap_create((disk_size(swap_device)*DISK_SECTOR_SIZE)/PGSIZE); // kys
-    if(swap_table == NULL) ASSERT(0);
+    if(swap_disk_names == NULL){
+        add_swap_disk(disk_get_role(DISK_ROLE_SWAP));
+    }
+    else{
+        char names[64];
+        char* name;
+        char* save_ptr;
 
-    bitmap_set_all(swap_table, 0);
-    lock_init(&swap_lock);
+        strlcpy(names, swap_disk_names, sizeof names);
+        for(name = strtok_r(names, ",", &save_ptr); name != NULL;
+            name = strtok_r(NULL, ",", &save_ptr)){
+            struct disk* d = disk_find(name);
+            if(d == NULL) PANIC("swap: no disk `%s'", name);
+            if(d == disk_get_role(DISK_ROLE_FS) || d == disk_get(0, 0))
+                PANIC("swap: `%s' holds the file system or kernel", name);
+            add_swap_disk(d);
+        }
+    }
+    if(swap_disk_cnt == 0) PANIC("no swap disk");
 }
 
+/* Adds D to the disks swap is spread over. */
+static void
+add_swap_disk(struct disk* d){
+    struct swap_disk* sd;
+    size_t i;
+
+    if(d == NULL) PANIC("swap disk not present");
+    for(i = 0; i < swap_disk_cnt; i++)
+        if(swap_disks[i].disk == d) PANIC("swap disk listed twice");
+    if(swap_disk_cnt == SWAP_DISK_MAX) PANIC("too many swap disks");
+
+    sd = &swap_disks[swap_disk_cnt];
+    sd->disk = d;
+    sd->used = bitmap_create(disk_size(d) / SECTORS_PER_PAGE);
+    sd->owner = malloc(sizeof *sd->owner * bitmap_size(sd->used));
+    if(sd->used == NULL || sd->owner == NULL) PANIC("swap: out of memory");
+    sd->cursor = 0;
+    sd->base = swap_disk_cnt > 0
+        ? sd[-1].base + bitmap_size(sd[-1].used) : 0;
+    swap_disk_cnt++;
+}
+
+/* Returns the swap disk that holds SLOT. */
+static struct swap_disk*
+find_swap_disk(size_t slot){
+    size_t i;
+
+    for(i = 0; i < swap_disk_cnt; i++){
+        struct swap_disk* sd = &swap_disks[i];
+        if(slot >= sd->base && slot - sd->base < bitmap_size(sd->used))
+            return sd;
+    }
+    PANIC("invalid swap slot %zu", slot);
+}
+
+/* Takes, on the least busy swap disk that has a free slot, by
+   queue depth, the first run of free slots at or after its cursor
+   that is WANT long, or else half that, and so on down to a single
+   slot.  Sets *START to the run's first slot on that disk and *CNT
+   to its length, and returns the disk.  Must be called with
+   swap_lock held. */
+static struct swap_disk*
+alloc_slots(size_t want, size_t* start, size_t* cnt){
+    struct swap_disk* best = NULL;
+    long long best_depth = 0;
+    size_t i, n;
+
+    ASSERT(lock_held_by_current_thread(&swap_lock));
+    ASSERT(want > 0);
+    for(i = 0; i < swap_disk_cnt; i++){
+        struct swap_disk* sd = &swap_disks[(swap_next_disk + i) % swap_disk_cnt];
+        long long depth = disk_queue_depth(sd->disk);
+        if(bitmap_all(sd->used, 0, bitmap_size(sd->used))) continue;
+        if(best == NULL || depth < best_depth){
+            best = sd;
+            best_depth = depth;
+        }
+    }
+    if(best == NULL) PANIC("bitmap full");
+    swap_next_disk = (best - swap_disks + 1) % swap_disk_cnt;
+
+    for(n = want; ; n /= 2){
+        size_t idx = bitmap_scan_and_flip(best->used, best->cursor, n, 0);
+        if(idx == BITMAP_ERROR && best->cursor > 0)
+            idx = bitmap_scan_and_flip(best->used, 0, n, 0);
+        if(idx != BITMAP_ERROR){
+            *start = idx;
+            *cnt = n;
+            best->cursor = idx + n;
+            return best;
+        }
+        ASSERT(n > 1);
+    }
+}
+
+/* Transfers the CNT pages at PAGES to or from CNT consecutive
+   slots of SD, starting at SLOT on that disk, as one request. */
+static void
+swap_transfer(struct swap_disk* sd, size_t slot, size_t cnt,
+              void* pages[], bool write){
+    void* sectors[SWAP_CLUSTER * SECTORS_PER_PAGE];
+    struct disk_request r;
+    struct semaphore done;
+    size_t i;
+
+    ASSERT(cnt <= SWAP_CLUSTER);
+    for(i = 0; i < cnt * SECTORS_PER_PAGE; i++)
+        sectors[i] = (uint8_t*) pages[i / SECTORS_PER_PAGE]
+                     + i % SECTORS_PER_PAGE * DISK_SECTOR_SIZE;
+    r.disk = sd->disk;
+    r.sec_no = slot * SECTORS_PER_PAGE;
+    r.cnt = cnt * SECTORS_PER_PAGE;
+    r.write = write;
+    r.class = write ? DISK_SWAP_OUT : DISK_SWAP_IN;
+    r.buffer = NULL;
+    r.buffers = sectors;
+    r.complete = disk_complete_sema;
+    r.aux = &done;
+    sema_init(&done, 0);
+    disk_submit(&r);
+    sema_down(&done);
+}
+
+/* Returns the swap cache entry that holds or is loading SLOT, or
+   a null pointer if none does. */
+static struct swap_cache_entry*
+swap_cache_find(size_t slot){
+    size_t i;
+
+    for(i = 0; i < SWAP_CACHE_PAGES; i++)
+        if(swap_cache[i].state != SC_EMPTY && swap_cache[i].slot == slot)
+            return &swap_cache[i];
+    return NULL;
+}
+
+/* Returns a swap cache entry to read a page into, dropping the
+   page it held, or a null pointer if all are being loaded.  Takes
+   them in turn, so the pages read around longest ago go first. */
+static struct swap_cache_entry*
+swap_cache_claim(void){
+    size_t i;
+
+    for(i = 0; i < SWAP_CACHE_PAGES; i++){
+        struct swap_cache_entry* e = &swap_cache[swap_cache_hand];
+        swap_cache_hand = (swap_cache_hand + 1) % SWAP_CACHE_PAGES;
+        if(e->state != SC_LOADING) return e;
+    }
+    return NULL;
+}
+
+/* swap_lock only covers the swap bitmaps and cache, not the disk
+   I/O, so other threads can get and queue their own swap I/O
+   meanwhile.
+
+   A page not in the swap cache is read along with the following
+   slots that hold pages of the same process, as swap_out_cluster()
+   likely wrote them together, up to SWAP_CLUSTER pages in all.
+   The others go into the swap cache for their own faults. */
 bool 
 swap_in (void *frame_addr, disk_sector_t sector_num)
 { 
     // printf("swap in\n");
+    size_t slot = sector_num / SECTORS_PER_PAGE;
+    struct swap_disk* sd = find_swap_disk(slot);
+    size_t idx = slot - sd->base;
+    struct swap_cache_entry* around[SWAP_CLUSTER];
+    void* pages[SWAP_CLUSTER];
+    struct swap_cache_entry* e;
+    tid_t owner;
+    size_t n, i;
+
     lock_acquire(&swap_lock);
-    disk_sector_t bitmap_idx = (sector_num * DISK_SECTOR_SIZE)/PGSIZE;
-    bool success = bitmap_test(swap_table, bitmap_idx);
+    bool success = bitmap_test(sd->used, idx);
     if(success == false) PANIC("invalid swap space!");
 
-    bitmap_flip(swap_table, bitmap_idx);
-    read_from_disk(frame_addr, sector_num);
+    while((e = swap_cache_find(slot)) != NULL && e->state == SC_LOADING)
+        cond_wait(&swap_cache_loaded, &swap_lock);
+    if(e != NULL){
+        memcpy(frame_addr, e->page, PGSIZE);
+        e->state = SC_EMPTY;
+        bitmap_reset(sd->used, idx);
+        lock_release(&swap_lock);
+        return true;
+    }
+
+    /* Forget the owner, so that no one reads this slot around
+       while we read it ourselves. */
+    owner = sd->owner[idx];
+    sd->owner[idx] = TID_ERROR;
+    pages[0] = frame_addr;
+    for(n = 1; n < SWAP_CLUSTER && owner != TID_ERROR; n++){
+        size_t next = idx + n;
+        if(next >= bitmap_size(sd->used) || !bitmap_test(sd->used, next)
+           || sd->owner[next] != owner
+           || swap_cache_find(slot + n) != NULL)
+            break;
+        around[n] = swap_cache_claim();
+        if(around[n] == NULL) break;
+        around[n]->state = SC_LOADING;
+        around[n]->slot = slot + n;
+        pages[n] = around[n]->page;
+    }
+    lock_release(&swap_lock);
+
+    /* free the slot only once it is read, so it cannot be reused under us */
+    swap_transfer(sd, idx, n, pages, false);
 
+    lock_acquire(&swap_lock);
+    for(i = 1; i < n; i++)
+        around[i]->state = SC_VALID;
+    if(n > 1) cond_broadcast(&swap_cache_loaded, &swap_lock);
+    bitmap_flip(sd->used, idx);
     lock_release(&swap_lock);
     return true;
 }
 
-disk_sector_t
-swap_out (void* frame_addr)
+/* Writes the CNT pages in FRAMES, of the processes with the ids in
+   OWNERS, to swap, and stores in SECTOR_NUMS where each went.  The
+   pages go to runs of consecutive slots, each written with a
+   single transfer, as long as free runs can be found. */
+void
+swap_out_cluster (void *frames[], const tid_t owners[], size_t cnt,
+                  disk_sector_t sector_nums[])
 {
-    // printf("swap out\n");
-    lock_acquire(&swap_lock);
-    void* addr =pg_round_down(frame_addr);
+    size_t done = 0;
 
-    disk_sector_t sector_num = get_empty_sector_num();
-    write_to_disk(frame_addr, sector_num);
+    ASSERT(cnt <= SWAP_CLUSTER);
+    while(done < cnt){
+        struct swap_disk* sd;
+        size_t start, n, i;
 
-    lock_release(&swap_lock);
-    return sector_num;
+        /* The owners are only published once the pages are on disk:
+           until then swap_in() must not read these slots around,
+           which would put a read of them on the disk queue next to
+           our write. */
+        lock_acquire(&swap_lock);
+        sd = alloc_slots(cnt - done, &start, &n);
+        for(i = 0; i < n; i++)
+            sd->owner[start + i] = TID_ERROR;
+        lock_release(&swap_lock);
+
+        swap_transfer(sd, start, n, frames + done, true);
+
+        lock_acquire(&swap_lock);
+        for(i = 0; i < n; i++){
+            sd->owner[start + i] = owners[done + i];
+            sector_nums[done + i] = (sd->base + start + i) * SECTORS_PER_PAGE;
+        }
+        lock_release(&swap_lock);
+        done += n;
+    }
 }
 
+/* Read a page from swap device into frame, as one disk command */
 void read_from_disk (void *frame_addr, disk_sector_t sector_num)
 {
-    disk_sector_t i;
-    for(i=0; i<PGSIZE/DISK_SECTOR_SIZE; i++){
-        void* dst = i*DISK_SECTOR_SIZE + frame_addr;
-        disk_read(swap_device, i+sector_num, dst);
-    }
+    struct swap_disk* sd = find_swap_disk(sector_num / SECTORS_PER_PAGE);
+    disk_read_multiple(sd->disk, sector_num - sd->base * SECTORS_PER_PAGE,
+                       SECTORS_PER_PAGE, frame_addr, DISK_SWAP_IN);
     return;
 }
 
 /* Write data to swap device from frame */
 void write_to_disk (void *frame_addr, disk_sector_t sector_num)
 {
-    disk_sector_t i;
-    for(i=0; i<PGSIZE/DISK_SECTOR_SIZE; i++){    
-        void* dst = i*DISK_SECTOR_SIZE + frame_addr; // total num is PGSIZE
-        disk_write(swap_device, i+sector_num, dst);
-    }
+    struct swap_disk* sd = find_swap_disk(sector_num / SECTORS_PER_PAGE);
+    disk_write_multiple(sd->disk, sector_num - sd->base * SECTORS_PER_PAGE,
+                        SECTORS_PER_PAGE, frame_addr, DISK_SWAP_OUT);
     return;
 }
 
+/* Takes a free slot, for a page of no known process, and returns
+   its first sector.  Must be called with swap_lock held. */
 disk_sector_t
 get_empty_sector_num(void){
+    size_t start, n;
+    struct swap_disk* sd = alloc_slots(1, &start, &n);
 
-    size_t bitmap_idx = bitmap_scan_and_flip(swap_table, 0, 1, 0);
-    // printf("bitmapidx : %d\n", bitmap_idx);
-    if(bitmap_idx != BITMAP_ERROR) return (bitmap_idx * PGSIZE)/DISK_SECTOR_SIZE;
-    else{
-        PANIC("bitmap full");
-    }
-}
\ No newline at end of file
+    sd->owner[start] = TID_ERROR;
+    return (sd->base + start) * SECTORS_PER_PAGE;
+}
@@ -3,23 +3,27 @@
 #include "devices/disk.h"
 
 #include "lib/kernel/bitmap.h"
+#include "threads/thread.h"
 
 #ifndef VM_SWAP_H
 #define VM_SWAP_H
 
 void swap_init (void);
+/* Most pages swapped out, or read around on swap-in, with one
+   disk transfer. */
+#define SWAP_CLUSTER 8
+
 bool swap_in (void *frame_addr, disk_sector_t sector_num);
-disk_sector_t swap_out (void *frame_addr);
+void swap_out_cluster (void *frames[], const tid_t owners[], size_t cnt,
+                       disk_sector_t sector_nums[]);
 void read_from_disk (void *frame_addr, disk_sector_t sector_num);
 void write_to_disk (void *frame_addr, disk_sector_t sector_num);
 disk_sector_t get_empty_sector_num(void);
-/* The swap device */
-struct disk *swap_device;
 
-/* Tracks in-use and free swap slots */
-struct bitmap *swap_table;
+/* Names of the disks to stripe swap across, set by -swap. */
+extern const char *swap_disk_names;
 
-/* Protects swap_table */
+/* Protects the swap slot bitmaps */
 struct lock swap_lock;
 
 